@@ -0,0 +1,521 @@
+///////////////////////////////////////////////////////////////////////////////
+// Measures an echo server over loopback TCP, built three ways on the pool:
+//     prethreaded     - a fixed pool of threads, each accepting a
+//                       connection and serving it until it closes
+//     thread_per_conn - an accepting thread starting a thread for every
+//                       connection
+//     epoll_pool      - an epoll loop queuing a pool task for every
+//                       readable connection
+// A client pool keeps every connection busy with one request at a time,
+// for a number of connections rising by factors of four, and prints CSV
+// with the requests per second, the latency percentiles in microseconds
+// and the connections that never got an answer.
+///////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "prethd.h"
+
+// Ways of building the server.
+enum {
+    SRV_PRETHREADED,            // pool of threads blocking in accept()
+    SRV_PER_CONN,               // one thread per connection
+    SRV_EPOLL,                  // epoll loop queuing pool tasks
+    SRV_LEN
+};
+
+static const char *srv_names[SRV_LEN] = {
+    "prethreaded", "thread_per_conn", "epoll_pool"
+};
+
+// The server under test.
+struct server_t {
+    int kind;                   // SRV_ value
+    int lfd;                    // listening socket
+    int efd;                    // epoll instance of SRV_EPOLL
+    int stop;                   // eventfd stopping the epoll loop
+    prethd_t *pool;             // serving threads
+    pthread_t loop;             // accepting or epoll thread
+    size_t closed;              // connections closed by the server
+};
+
+// Connection of the client.
+struct cconn_t {
+    int fd;                     // the socket
+    size_t got;                 // bytes of the answer received
+    size_t reqs;                // requests answered
+    double sent;                // time the request was sent
+};
+
+// The client load generator.
+struct client_t {
+    struct sockaddr_in addr;    // address of the server
+    size_t conns;               // number of connections
+    size_t len;                 // number of client threads
+    size_t size;                // request size in bytes
+    double dur;                 // running time in seconds
+    size_t role;                // next thread index to hand out
+    pthread_barrier_t ready;    // passed once every connection is open
+    double **lat;               // latency samples of each thread
+    size_t *nlat;               // number of samples of each thread
+    size_t starved;             // connections never answered
+};
+
+static struct server_t srv;
+
+static double now(void);
+static void server_start(int kind, size_t threads, size_t workers);
+static void server_stop(size_t conns);
+static void serve(int fd);
+static void *prethreaded(void *arg);
+static void *per_conn_accept(void *arg);
+static void *per_conn(void *arg);
+static void *epoll_loop(void *arg);
+static void *epoll_task(void *arg);
+static _Bool write_all(int fd, const char *buf, size_t len);
+static void *client(void *arg);
+static int dbl_cmp(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+    size_t threads = 64, workers = 0, max = 1024, cthreads = 2, size = 64;
+    double dur = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:w:n:c:s:d:")) != -1) {
+        switch (opt) {
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'w': workers = strtoul(optarg, NULL, 10); break;
+        case 'n': max = strtoul(optarg, NULL, 10); break;
+        case 'c': cthreads = strtoul(optarg, NULL, 10); break;
+        case 's': size = strtoul(optarg, NULL, 10); break;
+        case 'd': dur = strtod(optarg, NULL); break;
+        default:
+            fprintf(stderr, "usage: %s [-t prethreaded threads] "
+                "[-w epoll workers] [-n max connections] "
+                "[-c client threads] [-s request bytes] [-d seconds]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    if (threads == 0 || cthreads == 0 || size == 0 || dur <= 0)
+        return 1;
+
+    // Both ends of every connection live in this process.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("server,conns,requests,req_per_s,p50_us,p90_us,p99_us,p999_us,"
+        "max_us,starved\n");
+    for (int k = 0; k < SRV_LEN; k++) {
+        for (size_t n = 1; n <= max; n *= 4) {
+            server_start(k, threads, workers);
+
+            struct client_t c;
+            memset(&c, 0, sizeof c);
+            socklen_t alen = sizeof c.addr;
+            getsockname(srv.lfd, (struct sockaddr *)&c.addr, &alen);
+            c.conns = n;
+            c.len = (cthreads < n) ? cthreads : n;
+            c.size = size;
+            c.dur = dur;
+            c.lat = calloc(c.len, sizeof *c.lat);
+            c.nlat = calloc(c.len, sizeof *c.nlat);
+            pthread_barrier_init(&c.ready, NULL, (unsigned)c.len);
+            prethd_t *cp = prethd_new(c.len, 0, 0);
+            if (c.lat == NULL || c.nlat == NULL || cp == NULL ||
+                    prethd_all(cp, client, &c) != c.len)
+                return 1;
+            prethd_join(cp);
+            prethd_free(cp);
+            server_stop(n);
+            pthread_barrier_destroy(&c.ready);
+
+            size_t total = 0;
+            for (size_t i = 0; i < c.len; i++)
+                total += c.nlat[i];
+            double *v = malloc((total + 1) * (sizeof *v));
+            if (v == NULL)
+                return 1;
+            total = 0;
+            for (size_t i = 0; i < c.len; i++) {
+                memcpy(v + total, c.lat[i], c.nlat[i] * (sizeof *v));
+                total += c.nlat[i];
+                free(c.lat[i]);
+            }
+            qsort(v, total, sizeof *v, dbl_cmp);
+            if (total == 0)
+                v[0] = 0;
+            printf("%s,%zu,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%zu\n",
+                srv_names[k], n, total, (double)total / dur,
+                v[total / 2] * 1e6, v[total * 9 / 10] * 1e6,
+                v[total * 99 / 100] * 1e6, v[total * 999 / 1000] * 1e6,
+                v[(total > 0) ? total - 1 : 0] * 1e6, c.starved);
+            fflush(stdout);
+            free(v);
+            free(c.lat);
+            free(c.nlat);
+        }
+    }
+    return 0;
+}
+
+// Returns the time since an arbitrary point in seconds.
+//
+// RETURN:
+// The monotonic time.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Starts the server on an ephemeral loopback port. Exits on error.
+//
+// PARAMS:
+// kind    - SRV_ value
+// threads - pool size of SRV_PRETHREADED
+// workers - pool size of SRV_EPOLL
+static void server_start(int kind, size_t threads, size_t workers) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memset(&srv, 0, sizeof srv);
+    srv.kind = kind;
+    srv.lfd = socket(AF_INET, SOCK_STREAM | ((kind == SRV_EPOLL) ?
+        SOCK_NONBLOCK : 0), 0);
+    if (srv.lfd < 0 || bind(srv.lfd, (struct sockaddr *)&addr,
+            sizeof addr) != 0 || listen(srv.lfd, SOMAXCONN) != 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    int ret = 0;
+    switch (kind) {
+    case SRV_PRETHREADED:
+        srv.pool = prethd_new(threads, 0, 0);
+        ret = srv.pool == NULL ||
+            prethd_all(srv.pool, prethreaded, NULL) != threads;
+        break;
+    case SRV_PER_CONN:
+        ret = pthread_create(&srv.loop, NULL, per_conn_accept, NULL);
+        break;
+    default:
+        srv.efd = epoll_create1(0);
+        srv.stop = eventfd(0, 0);
+        srv.pool = prethd_new(workers, 0, 0);
+        struct epoll_event ev = { .events = EPOLLIN };
+        ev.data.fd = srv.lfd;
+        ret = srv.efd < 0 || srv.stop < 0 || srv.pool == NULL ||
+            epoll_ctl(srv.efd, EPOLL_CTL_ADD, srv.lfd, &ev) != 0;
+        ev.data.fd = srv.stop;
+        ret = ret || epoll_ctl(srv.efd, EPOLL_CTL_ADD, srv.stop, &ev) != 0 ||
+            prethd_start(srv.pool) != workers ||
+            pthread_create(&srv.loop, NULL, epoll_loop, NULL) != 0;
+        break;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "cannot start %s server\n", srv_names[kind]);
+        exit(1);
+    }
+}
+
+// Waits for the server to close every connection of a run, then stops it.
+//
+// PARAMS:
+// conns - number of connections the client opened
+static void server_stop(size_t conns) {
+    double end = now() + 10;
+    while (__atomic_load_n(&srv.closed, __ATOMIC_ACQUIRE) < conns &&
+            now() < end)
+        usleep(1000);
+    if (__atomic_load_n(&srv.closed, __ATOMIC_ACQUIRE) < conns)
+        fprintf(stderr, "%s: connections left open\n", srv_names[srv.kind]);
+
+    uint64_t one = 1;
+    switch (srv.kind) {
+    case SRV_PRETHREADED:
+        shutdown(srv.lfd, SHUT_RDWR);   // fails the blocked accept() calls
+        prethd_join(srv.pool);
+        prethd_free(srv.pool);
+        break;
+    case SRV_PER_CONN:
+        shutdown(srv.lfd, SHUT_RDWR);
+        pthread_join(srv.loop, NULL);
+        break;
+    default:
+        if (write(srv.stop, &one, sizeof one) != sizeof one)
+            exit(1);
+        pthread_join(srv.loop, NULL);
+        prethd_join_free(srv.pool);
+        close(srv.stop);
+        close(srv.efd);
+        break;
+    }
+    close(srv.lfd);
+}
+
+// Echoes a blocking connection until the client closes it.
+//
+// PARAMS:
+// fd - the connection
+static void serve(int fd) {
+    char buf[4096];
+    int one = 1;
+    ssize_t r;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    while ((r = read(fd, buf, sizeof buf)) > 0 ||
+            (r < 0 && errno == EINTR)) {
+        if (r > 0 && !write_all(fd, buf, (size_t)r))
+            break;
+    }
+    close(fd);
+    __atomic_add_fetch(&srv.closed, 1, __ATOMIC_RELEASE);
+}
+
+// Thread of the prethreaded server: accepts and serves one connection at a
+// time until the listening socket is shut down.
+//
+// PARAMS:
+// arg - unused
+//
+// RETURN:
+// NULL.
+static void *prethreaded(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = accept(srv.lfd, NULL, NULL);
+        if (fd >= 0)
+            serve(fd);
+        else if (errno != EINTR && errno != ECONNABORTED)
+            return NULL;
+    }
+}
+
+// Accepting thread of the thread-per-connection server: starts a detached
+// thread for every connection until the listening socket is shut down.
+//
+// PARAMS:
+// arg - unused
+//
+// RETURN:
+// NULL.
+static void *per_conn_accept(void *arg) {
+    (void)arg;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        pthread_t t;
+        int fd = accept(srv.lfd, NULL, NULL);
+        if (fd < 0 && errno != EINTR && errno != ECONNABORTED)
+            break;
+        if (fd >= 0 && pthread_create(&t, &attr, per_conn,
+                (void *)(intptr_t)fd) != 0)
+            serve(fd);      // no thread left, serve it here
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+// Thread of the thread-per-connection server.
+//
+// PARAMS:
+// arg - the connection
+//
+// RETURN:
+// NULL.
+static void *per_conn(void *arg) {
+    serve((int)(intptr_t)arg);
+    return NULL;
+}
+
+// Thread of the epoll server: accepts connections and queues a task for
+// each readable one. A connection is armed for one event at a time, so no
+// two tasks serve it at once.
+//
+// PARAMS:
+// arg - unused
+//
+// RETURN:
+// NULL.
+static void *epoll_loop(void *arg) {
+    (void)arg;
+    struct epoll_event evs[64];
+    int one = 1;
+    for (;;) {
+        int n = epoll_wait(srv.efd, evs, 64, -1);
+        for (int i = 0; i < n; i++) {
+            int fd = evs[i].data.fd;
+            if (fd == srv.stop)
+                return NULL;
+            if (fd != srv.lfd) {
+                prethd_submit(srv.pool, epoll_task, (void *)(intptr_t)fd);
+                continue;
+            }
+            while ((fd = accept4(srv.lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+                ev.data.fd = fd;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+                epoll_ctl(srv.efd, EPOLL_CTL_ADD, fd, &ev);
+            }
+        }
+    }
+}
+
+// Task of the epoll server: echoes what a connection has to read, then
+// arms it again, or closes it once the client has.
+//
+// PARAMS:
+// arg - the connection
+//
+// RETURN:
+// NULL.
+static void *epoll_task(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[4096];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof buf)) > 0) {
+        if (!write_all(fd, buf, (size_t)r))
+            break;
+    }
+    if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+        ev.data.fd = fd;
+        epoll_ctl(srv.efd, EPOLL_CTL_MOD, fd, &ev);
+    } else {
+        close(fd);
+        __atomic_add_fetch(&srv.closed, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Writes a whole buffer to a socket, blocking or not.
+//
+// PARAMS:
+// fd  - the socket
+// buf - bytes to write
+// len - number of bytes
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+static _Bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && (errno == EAGAIN || errno == EINTR)) {
+            sched_yield();
+            continue;
+        }
+        if (w <= 0)
+            return false;
+        buf += w;
+        len -= (size_t)w;
+    }
+    return true;
+}
+
+// Thread of the client: opens its share of the connections and keeps one
+// request in flight on each until the running time is up.
+//
+// PARAMS:
+// arg - the client
+//
+// RETURN:
+// NULL.
+static void *client(void *arg) {
+    struct client_t *c = arg;
+    size_t me = __atomic_fetch_add(&c->role, 1, __ATOMIC_RELAXED);
+    size_t lo = c->conns * me / c->len, n = c->conns * (me + 1) / c->len - lo;
+    struct cconn_t *cs = calloc(n, sizeof *cs);
+    char *msg = malloc(c->size), *buf = malloc(c->size);
+    size_t cap = 1024, len = 0;
+    double *lat = malloc(cap * (sizeof *lat));
+    int ep = epoll_create1(0), one = 1;
+    if (cs == NULL || msg == NULL || buf == NULL || lat == NULL || ep < 0)
+        exit(1);
+    memset(msg, 'x', c->size);
+
+    for (size_t i = 0; i < n; i++) {
+        struct epoll_event ev = { .events = EPOLLIN };
+        ev.data.u64 = i;
+        cs[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (cs[i].fd < 0 || connect(cs[i].fd, (struct sockaddr *)&c->addr,
+                sizeof c->addr) != 0) {
+            perror("connect");
+            exit(1);
+        }
+        setsockopt(cs[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        epoll_ctl(ep, EPOLL_CTL_ADD, cs[i].fd, &ev);
+    }
+
+    pthread_barrier_wait(&c->ready);
+    double end = now() + c->dur;
+    for (size_t i = 0; i < n; i++) {
+        cs[i].sent = now();
+        write_all(cs[i].fd, msg, c->size);
+    }
+    while (now() < end) {
+        struct epoll_event evs[64];
+        int k = epoll_wait(ep, evs, 64, 10);
+        for (int j = 0; j < k; j++) {
+            struct cconn_t *cn = cs + evs[j].data.u64;
+            ssize_t r = read(cn->fd, buf, c->size - cn->got);
+            if (r <= 0)
+                continue;
+            cn->got += (size_t)r;
+            if (cn->got < c->size)
+                continue;
+            double t = now();
+            if (len == cap) {
+                cap *= 2;
+                lat = realloc(lat, cap * (sizeof *lat));
+                if (lat == NULL)
+                    exit(1);
+            }
+            lat[len++] = t - cn->sent;
+            cn->reqs++;
+            cn->got = 0;
+            cn->sent = t;
+            write_all(cn->fd, msg, c->size);
+        }
+    }
+
+    size_t starved = 0;
+    for (size_t i = 0; i < n; i++) {
+        starved += cs[i].reqs == 0;
+        close(cs[i].fd);
+    }
+    __atomic_add_fetch(&c->starved, starved, __ATOMIC_RELAXED);
+    c->lat[me] = lat;
+    c->nlat[me] = len;
+    close(ep);
+    free(cs);
+    free(msg);
+    free(buf);
+    return NULL;
+}
+
+// Orders doubles, for qsort().
+static int dbl_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
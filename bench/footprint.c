@@ -0,0 +1,162 @@
+///////////////////////////////////////////////////////////////////////////////
+// Measures the memory cost of very large pools: starts pools of 1k threads
+// and up, by factors of ten, with several stack sizes and guard settings,
+// and prints CSV with the resident and virtual size the pool added, the
+// page faults taken and the time to create and tear down each thread.
+//
+// Every pool runs in a child process of its own, so each measurement
+// starts from the same footprint. The resident size is taken once every
+// thread has run a task, and so has touched its stack. A pool that could
+// not start all its threads, e.g. past the kernel's map or thread limits,
+// is measured with the threads it has.
+///////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "prethd.h"
+
+// Stack configuration of a pool.
+struct conf_t {
+    const char *name;           // name printed in the CSV
+    size_t stack;               // stack size, 0 for the default
+    size_t guard;               // guard size, SIZE_MAX for the default
+};
+
+static const struct conf_t confs[] = {
+    { "default", 0, SIZE_MAX },
+    { "1m", 1 << 20, SIZE_MAX },
+    { "256k", 256 << 10, SIZE_MAX },
+    { "64k", 64 << 10, SIZE_MAX },
+    { "64k_noguard", 64 << 10, 0 },
+    { "16k", 16 << 10, SIZE_MAX }
+};
+
+static pthread_barrier_t barrier;
+
+static double now(void);
+static void measure(const struct conf_t *conf, size_t n);
+static void *touch(void *arg);
+static void mem_kb(long *rss, long *vsz);
+
+int main(int argc, char **argv) {
+    size_t max = 100000;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        if (opt != 'm') {
+            fprintf(stderr, "usage: %s [-m max threads]\n", argv[0]);
+            return 1;
+        }
+        max = strtoul(optarg, NULL, 10);
+    }
+
+    printf("stack,threads,started,rss_kb,vsz_kb,rss_kb_per_thread,"
+        "vsz_kb_per_thread,minflt,majflt,create_us_per_thread,"
+        "teardown_us_per_thread\n");
+    for (size_t c = 0; c < sizeof confs / sizeof *confs; c++) {
+        for (size_t n = 1000; n <= max; n *= 10) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0)
+                return 1;
+            if (pid == 0) {
+                measure(confs + c, n);
+                fflush(stdout);
+                _exit(0);
+            }
+            int status;
+            if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+                    WEXITSTATUS(status) != 0)
+                fprintf(stderr, "%s,%zu: child failed\n", confs[c].name, n);
+        }
+    }
+    return 0;
+}
+
+// Returns the time since an arbitrary point in seconds.
+//
+// RETURN:
+// The monotonic time.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Starts a pool, has every thread run a task, tears the pool down and
+// prints a CSV row of what it cost.
+//
+// PARAMS:
+// conf - stack configuration of the pool
+// n    - number of threads
+static void measure(const struct conf_t *conf, size_t n) {
+    long rss0, vsz0, rss1, vsz1;
+    struct rusage r0, r1;
+    mem_kb(&rss0, &vsz0);
+    getrusage(RUSAGE_SELF, &r0);
+
+    prethd_t *th = prethd_new(n, 0, 0);
+    if (th == NULL || !prethd_stack(th, conf->stack, conf->guard)) {
+        fprintf(stderr, "%s: cannot set up pool\n", conf->name);
+        exit(1);
+    }
+    double t = now();
+    size_t started = prethd_start(th);
+    double create = now() - t;
+
+    // Every thread blocks in its task until all have one, so none runs two.
+    pthread_barrier_init(&barrier, NULL, (unsigned)started + 1);
+    for (size_t i = 0; i < started; i++)
+        prethd_submit(th, touch, NULL);
+    pthread_barrier_wait(&barrier);
+    mem_kb(&rss1, &vsz1);
+    getrusage(RUSAGE_SELF, &r1);
+
+    t = now();
+    prethd_join_free(th);
+    double teardown = now() - t;
+    pthread_barrier_destroy(&barrier);
+
+    double k = (started > 0) ? (double)started : 1;
+    printf("%s,%zu,%zu,%ld,%ld,%.2f,%.2f,%ld,%ld,%.2f,%.2f\n", conf->name,
+        n, started, rss1 - rss0, vsz1 - vsz0, (double)(rss1 - rss0) / k,
+        (double)(vsz1 - vsz0) / k, r1.ru_minflt - r0.ru_minflt,
+        r1.ru_majflt - r0.ru_majflt, create * 1e6 / k, teardown * 1e6 / k);
+}
+
+// Task of the pool: waits until every thread of the pool runs one.
+//
+// PARAMS:
+// arg - unused
+//
+// RETURN:
+// NULL.
+static void *touch(void *arg) {
+    (void)arg;
+    pthread_barrier_wait(&barrier);
+    return NULL;
+}
+
+// Reads the resident and virtual size of the process.
+//
+// PARAMS:
+// rss - receives the resident size in kB
+// vsz - receives the virtual size in kB
+static void mem_kb(long *rss, long *vsz) {
+    char line[256];
+    FILE *f = fopen("/proc/self/status", "r");
+    *rss = 0;
+    *vsz = 0;
+    while (f != NULL && fgets(line, sizeof line, f) != NULL) {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+            *rss = strtol(line + 6, NULL, 10);
+        else if (strncmp(line, "VmSize:", 7) == 0)
+            *vsz = strtol(line + 7, NULL, 10);
+    }
+    if (f != NULL)
+        fclose(f);
+}
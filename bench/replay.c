@@ -0,0 +1,301 @@
+///////////////////////////////////////////////////////////////////////////////
+// Replays a recorded trace of tasks against a thread pool, at scaled
+// speed, and reports latency and throughput.
+//
+// The trace has one task per line, with ids numbered from 0:
+//     id arrival_us duration_us ndeps dep...
+// A task is queued once it has arrived and every task it depends on has
+// returned, and then spins for its duration. Lines starting with # are
+// skipped. Run with -g n to print a synthetic trace of n tasks.
+///////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "prethd.h"
+
+// Task of the trace.
+struct rtask_t {
+    double arrival;             // arrival time, seconds from the start
+    double duration;            // running time in seconds
+    size_t *deps;               // tasks depended on
+    size_t ndeps;               // number of tasks depended on
+    size_t *outs;               // tasks depending on this one
+    size_t nouts;               // number of tasks depending on this one
+    size_t pending;             // arrival and dependencies still missing
+    double ready;               // time queued
+    double start;               // time started
+    double finish;              // time returned
+};
+
+// The replay.
+struct replay_t {
+    prethd_t *pool;             // the pool under test
+    struct rtask_t *tasks;      // tasks of the trace
+    size_t len;                 // number of tasks
+    double t0;                  // start of the replay
+    _Bool sleep;                // tasks sleep rather than spin
+};
+
+static struct replay_t rp;
+
+static double now(void);
+static void release(size_t i);
+static void *run(void *arg);
+static _Bool load(FILE *in, double speed);
+static void generate(size_t n);
+static int dbl_cmp(const void *a, const void *b);
+static void report(const char *name, double *v, size_t n);
+
+int main(int argc, char **argv) {
+    size_t th = 4, coalesce = 0, gen = 0;
+    double speed = 1;
+    const char *path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:k:g:b")) != -1) {
+        switch (opt) {
+        case 't': th = strtoul(optarg, NULL, 10); break;
+        case 's': speed = strtod(optarg, NULL); break;
+        case 'k': coalesce = strtoul(optarg, NULL, 10); break;
+        case 'g': gen = strtoul(optarg, NULL, 10); break;
+        case 'b': rp.sleep = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-s speed] "
+                "[-k coalesce] [-b] [trace]\n       %s -g tasks\n",
+                argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (gen > 0) {
+        generate(gen);
+        return 0;
+    }
+    if (optind < argc)
+        path = argv[optind];
+
+    FILE *in = (path == NULL) ? stdin : fopen(path, "r");
+    if (in == NULL || speed <= 0 || !load(in, speed)) {
+        fprintf(stderr, "cannot load trace\n");
+        return 1;
+    }
+    if (in != stdin)
+        fclose(in);
+
+    rp.pool = prethd_new(th, 0, 0);
+    if (rp.pool == NULL || (coalesce > 0 &&
+            !prethd_coalesce(rp.pool, 0, coalesce)) ||
+            prethd_start(rp.pool) == 0) {
+        fprintf(stderr, "cannot start pool\n");
+        return 1;
+    }
+
+    // Trace lines are in arrival order, as load() checked.
+    rp.t0 = now();
+    for (size_t i = 0; i < rp.len; i++) {
+        double wait = rp.t0 + rp.tasks[i].arrival - now();
+        if (wait > 0) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)wait;
+            ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+            while (nanosleep(&ts, &ts) != 0)
+                ;
+        }
+        release(i);
+    }
+    prethd_join_free(rp.pool);
+
+    double *resp = malloc(rp.len * (sizeof *resp));
+    double *wait = malloc(rp.len * (sizeof *wait));
+    if (resp == NULL || wait == NULL)
+        return 1;
+    double end = 0, work = 0;
+    for (size_t i = 0; i < rp.len; i++) {
+        struct rtask_t *t = rp.tasks + i;
+        resp[i] = (t->finish - t->arrival) * 1e3;
+        wait[i] = (t->start - t->ready) * 1e3;
+        end = (t->finish > end) ? t->finish : end;
+        work += t->finish - t->start;
+    }
+    printf("threads %zu coalesce %zu speed %g tasks %zu\n", th, coalesce,
+        speed, rp.len);
+    printf("makespan_s %.6f throughput_tps %.1f utilisation %.3f\n", end,
+        (end > 0) ? (double)rp.len / end : 0, (end > 0) ?
+        work / (end * (double)th) : 0);
+    report("response_ms", resp, rp.len);
+    report("queue_wait_ms", wait, rp.len);
+    return 0;
+}
+
+// Returns the time since an arbitrary point in seconds.
+//
+// RETURN:
+// The monotonic time.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Gives a task one of the things it waits for, its arrival or a task it
+// depends on, and queues it once it has all of them.
+//
+// PARAMS:
+// i - index of the task
+static void release(size_t i) {
+    struct rtask_t *t = rp.tasks + i;
+    if (__atomic_sub_fetch(&t->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        t->ready = now() - rp.t0;
+        if (!prethd_submit(rp.pool, run, t)) {
+            fprintf(stderr, "cannot queue task %zu\n", i);
+            exit(1);
+        }
+    }
+}
+
+// Task of the pool: spins or sleeps for the duration of a trace task,
+// then releases the tasks depending on it.
+//
+// PARAMS:
+// arg - the trace task
+//
+// RETURN:
+// NULL.
+static void *run(void *arg) {
+    struct rtask_t *t = arg;
+    t->start = now() - rp.t0;
+    if (rp.sleep) {
+        usleep((useconds_t)(t->duration * 1e6));
+    } else {
+        while (now() - rp.t0 - t->start < t->duration)
+            ;
+    }
+    t->finish = now() - rp.t0;
+    for (size_t j = 0; j < t->nouts; j++)
+        release(t->outs[j]);
+    return NULL;
+}
+
+// Reads a trace and links every task to the tasks depending on it.
+//
+// PARAMS:
+// in    - the trace
+// speed - factor to speed the trace up by
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+static _Bool load(FILE *in, double speed) {
+    size_t cap = 0;
+    char line[4096];
+    while (fgets(line, sizeof line, in) != NULL) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (strchr(line, '\n') == NULL && !feof(in))
+            return false;       // longer than the buffer
+        char *p = line, *end;
+        size_t id = strtoul(p, &end, 10);
+        _Bool ok = end != p;
+        double arr = strtod(p = end, &end);
+        ok = ok && end != p;
+        double dur = strtod(p = end, &end);
+        ok = ok && end != p;
+        size_t nd = strtoul(p = end, &end, 10);
+        ok = ok && end != p && nd < sizeof line;    // no room for more
+        if (!ok || id != rp.len)
+            return false;       // ids must follow the line order
+        if (rp.len == cap) {
+            cap = (cap == 0) ? 1024 : cap * 2;
+            void *mem = realloc(rp.tasks, cap * (sizeof *rp.tasks));
+            if (mem == NULL)
+                return false;
+            rp.tasks = mem;
+        }
+        struct rtask_t *t = rp.tasks + rp.len;
+        memset(t, 0, sizeof *t);
+        t->arrival = arr / 1e6 / speed;
+        t->duration = dur / 1e6 / speed;
+        t->ndeps = nd;
+        t->deps = malloc((nd + 1) * (sizeof *t->deps));
+        if (t->deps == NULL)
+            return false;
+        for (size_t j = 0; j < nd; j++) {
+            t->deps[j] = strtoul(p = end, &end, 10);
+            if (end == p || t->deps[j] >= id) {
+                free(t->deps);
+                return false;   // tasks depend on earlier ones only
+            }
+        }
+        if (end[strspn(end, " \t\r\n")] != '\0') {
+            free(t->deps);
+            return false;       // more than ndeps dependencies
+        }
+        rp.len++;
+    }
+
+    // Count, then fill the lists of dependent tasks.
+    for (size_t i = 0; i < rp.len; i++)
+        for (size_t j = 0; j < rp.tasks[i].ndeps; j++)
+            rp.tasks[rp.tasks[i].deps[j]].nouts++;
+    for (size_t i = 0; i < rp.len; i++) {
+        struct rtask_t *t = rp.tasks + i;
+        t->outs = malloc((t->nouts + 1) * (sizeof *t->outs));
+        if (t->outs == NULL)
+            return false;
+        t->pending = t->ndeps + 1;
+        t->nouts = 0;
+    }
+    for (size_t i = 0; i < rp.len; i++) {
+        for (size_t j = 0; j < rp.tasks[i].ndeps; j++) {
+            struct rtask_t *d = rp.tasks + rp.tasks[i].deps[j];
+            d->outs[d->nouts++] = i;
+        }
+    }
+
+    for (size_t i = 1; i < rp.len; i++)
+        if (rp.tasks[i].arrival < rp.tasks[i - 1].arrival)
+            return false;       // lines must be in arrival order
+    return rp.len > 0;
+}
+
+// Prints a synthetic trace: Poisson arrivals at 2000 tasks per second,
+// exponential durations averaging 200us, and each task depending on up to
+// two recent tasks.
+//
+// PARAMS:
+// n - number of tasks
+static void generate(size_t n) {
+    prethd_rng_t r;
+    prethd_rng_init(&r, 42, 0);
+    double arr = 0;
+    printf("# id arrival_us duration_us ndeps dep...\n");
+    for (size_t i = 0; i < n; i++) {
+        arr += -500 * log1p(-prethd_rng_double(&r));
+        double dur = -200 * log1p(-prethd_rng_double(&r));
+        size_t nd = (i < 8) ? 0 : prethd_rng_u32(&r) % 3;
+        printf("%zu %.0f %.0f %zu", i, arr, dur, nd);
+        for (size_t j = 0; j < nd; j++)
+            printf(" %zu", i - 1 - prethd_rng_u32(&r) % 8);
+        printf("\n");
+    }
+}
+
+// Orders doubles, for qsort().
+static int dbl_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Prints the percentiles of a set of samples.
+//
+// PARAMS:
+// name - name of the samples
+// v    - the samples, sorted in place
+// n    - number of samples
+static void report(const char *name, double *v, size_t n) {
+    qsort(v, n, sizeof *v, dbl_cmp);
+    printf("%s p50 %.3f p90 %.3f p99 %.3f p999 %.3f max %.3f\n", name,
+        v[n / 2], v[n * 9 / 10], v[n * 99 / 100], v[n * 999 / 1000],
+        v[n - 1]);
+}
@@ -0,0 +1,620 @@
+///////////////////////////////////////////////////////////////////////////////
+// Runs a set of pool workloads across thread counts, from 1 to twice the
+// number of CPUs, and across thread placement policies, and prints CSV
+// with the time, speedup and efficiency of each run next to its context
+// switch counts, to find the point past which a workload stops scaling.
+// Times are the median of the repetitions; context switches and CPU times
+// are averaged over them. Both cover the run of the workload alone: the
+// pool is started and the input built before the clock starts, and both
+// are torn down after it stops.
+//
+// Placement policies:
+//     none    - threads run anywhere
+//     compact - thread i on the i-th CPU, filling sibling CPUs first
+//     scatter - threads spread over sockets, then cores, then siblings
+///////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "prethd.h"
+
+// CPU of the machine and its place in the topology.
+struct cpu_t {
+    int id;                     // CPU number
+    int pkg;                    // socket
+    int core;                   // core within the socket
+    int sib;                    // rank among the CPUs of its core
+    int crank;                  // rank of its core within the socket
+};
+
+// Workload run on a pool. Only run is timed.
+struct work_t {
+    const char *name;           // name printed in the CSV
+    void *(*setup)(prethd_t *th, size_t scale); // builds the input, or NULL
+    void (*run)(prethd_t *th, void *ctx);       // runs the workload once
+    void (*teardown)(void *ctx);                // frees the input
+};
+
+static void *tasks_setup(prethd_t *th, size_t scale);
+static void tasks_run(prethd_t *th, void *ctx);
+static void *histogram_setup(prethd_t *th, size_t scale);
+static void histogram_run(prethd_t *th, void *ctx);
+static void *filter_setup(prethd_t *th, size_t scale);
+static void filter_run(prethd_t *th, void *ctx);
+static void filter_teardown(void *ctx);
+static void *fib_setup(prethd_t *th, size_t scale);
+static void fib_run(prethd_t *th, void *ctx);
+static void *skiplist_setup(prethd_t *th, size_t scale);
+static void skiplist_run(prethd_t *th, void *ctx);
+static void skiplist_teardown(void *ctx);
+static void *bfs_setup(prethd_t *th, size_t scale);
+static void bfs_run(prethd_t *th, void *ctx);
+static void bfs_teardown(void *ctx);
+
+static const struct work_t works[] = {
+    { "tasks", tasks_setup, tasks_run, free },
+    { "histogram", histogram_setup, histogram_run, free },
+    { "filter", filter_setup, filter_run, filter_teardown },
+    { "fib", fib_setup, fib_run, free },
+    { "skiplist", skiplist_setup, skiplist_run, skiplist_teardown },
+    { "bfs", bfs_setup, bfs_run, bfs_teardown }
+};
+
+static double now(void);
+static double secs(struct timeval tv);
+static size_t topology(struct cpu_t *cpus);
+static int read_int(int cpu, const char *file);
+static int compact_cmp(const void *a, const void *b);
+static int scatter_cmp(const void *a, const void *b);
+static int dbl_cmp(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+    size_t scale = 1, reps = 3, max = 0;
+    const char *only = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:s:r:m:")) != -1) {
+        switch (opt) {
+        case 'w': only = optarg; break;
+        case 's': scale = strtoul(optarg, NULL, 10); break;
+        case 'r': reps = strtoul(optarg, NULL, 10); break;
+        case 'm': max = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-w workload] [-s scale] [-r reps] "
+                "[-m max threads]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static struct cpu_t cpus[CPU_SETSIZE];
+    size_t ncpu = topology(cpus);
+    if (ncpu == 0 || scale == 0 || reps == 0)
+        return 1;
+    if (max == 0)
+        max = 2 * ncpu;
+    int *ids = malloc(ncpu * (sizeof *ids));
+    double *times = malloc(reps * (sizeof *times));
+    if (ids == NULL || times == NULL)
+        return 1;
+
+    const char *policies[] = { "none", "compact", "scatter" };
+    printf("workload,policy,threads,seconds,speedup,efficiency,"
+        "vol_ctxsw,invol_ctxsw,user_s,sys_s\n");
+    for (size_t w = 0; w < sizeof works / sizeof *works; w++) {
+        if (only != NULL && strcmp(only, works[w].name) != 0)
+            continue;
+        for (size_t p = 0; p < sizeof policies / sizeof *policies; p++) {
+            if (p > 0) {
+                qsort(cpus, ncpu, sizeof *cpus,
+                    (p == 1) ? compact_cmp : scatter_cmp);
+                for (size_t i = 0; i < ncpu; i++)
+                    ids[i] = cpus[i].id;
+            }
+            double base = 0;
+            for (size_t n = 1; n <= max; n++) {
+                double vol = 0, invol = 0, user = 0, sys = 0;
+                for (size_t r = 0; r < reps; r++) {
+                    prethd_t *th = prethd_new(n, 0, 0);
+                    if (th == NULL || (p > 0 &&
+                            !prethd_affinity(th, ids, ncpu)) ||
+                            prethd_start(th) == 0)
+                        return 1;
+                    void *ctx = works[w].setup(th, scale);
+                    if (ctx == NULL) {
+                        fprintf(stderr, "%s: cannot set up\n",
+                            works[w].name);
+                        return 1;
+                    }
+
+                    struct rusage r0, r1;
+                    getrusage(RUSAGE_SELF, &r0);
+                    double t = now();
+                    works[w].run(th, ctx);
+                    times[r] = now() - t;
+                    getrusage(RUSAGE_SELF, &r1);
+
+                    works[w].teardown(ctx);
+                    prethd_join_free(th);
+                    vol += (double)(r1.ru_nvcsw - r0.ru_nvcsw);
+                    invol += (double)(r1.ru_nivcsw - r0.ru_nivcsw);
+                    user += secs(r1.ru_utime) - secs(r0.ru_utime);
+                    sys += secs(r1.ru_stime) - secs(r0.ru_stime);
+                }
+                qsort(times, reps, sizeof *times, dbl_cmp);
+                double t = times[reps / 2], k = (double)reps;
+                if (n == 1)
+                    base = t;
+                printf("%s,%s,%zu,%.6f,%.3f,%.3f,%.1f,%.1f,%.4f,%.4f\n",
+                    works[w].name, policies[p], n, t, base / t,
+                    base / t / (double)n, vol / k, invol / k, user / k,
+                    sys / k);
+                fflush(stdout);
+            }
+        }
+    }
+    free(ids);
+    free(times);
+    return 0;
+}
+
+// Task of the tasks workload: a few microseconds of arithmetic.
+static void *spin_task(void *arg) {
+    volatile size_t x = (size_t)arg;
+    for (size_t i = 0; i < 2000; i++)
+        x += i;
+    return NULL;
+}
+
+// Input of the tasks workload.
+struct tasks_t {
+    size_t n;                   // number of tasks
+};
+
+// Sets up the tasks workload.
+//
+// PARAMS:
+// th    - the pool
+// scale - size factor
+//
+// RETURN:
+// The input, or NULL on error.
+static void *tasks_setup(prethd_t *th, size_t scale) {
+    (void)th;
+    struct tasks_t *in = malloc(sizeof *in);
+    if (in != NULL)
+        in->n = 100000 * scale;
+    return in;
+}
+
+// Queues many small independent tasks from outside the pool.
+//
+// PARAMS:
+// th  - the pool
+// ctx - the input
+static void tasks_run(prethd_t *th, void *ctx) {
+    struct tasks_t *in = ctx;
+    for (size_t i = 0; i < in->n; i++)
+        prethd_submit(th, spin_task, (void *)i);
+    prethd_join(th);
+}
+
+// Bin of a histogram item.
+static size_t hist_bin(const void *item, void *ctx) {
+    (void)ctx;
+    return *(const uint32_t *)item % 256;
+}
+
+// Input of the histogram and filter workloads.
+struct array_t {
+    size_t n;                   // number of items
+    uint32_t *data;             // the items
+    uint32_t *out;              // output of the filter, or NULL
+};
+
+// Sets up the histogram workload.
+//
+// PARAMS:
+// th    - the pool
+// scale - size factor
+//
+// RETURN:
+// The input, or NULL on error.
+static void *histogram_setup(prethd_t *th, size_t scale) {
+    (void)th;
+    size_t n = 8000000 * scale;
+    struct array_t *in = malloc(sizeof *in + n * (sizeof *in->data));
+    if (in == NULL)
+        return NULL;
+    in->n = n;
+    in->data = (uint32_t *)(in + 1);
+    in->out = NULL;
+    for (size_t i = 0; i < n; i++)
+        in->data[i] = (uint32_t)(i * 2654435761u);
+    return in;
+}
+
+// Counts a large array into 256 bins.
+//
+// PARAMS:
+// th  - the pool
+// ctx - the input
+static void histogram_run(prethd_t *th, void *ctx) {
+    struct array_t *in = ctx;
+    size_t counts[256];
+    prethd_parallel_histogram(th, in->data, in->n, sizeof *in->data,
+        hist_bin, NULL, counts, 256);
+}
+
+// Predicate of the filter workload.
+static _Bool even(const void *item, void *ctx) {
+    (void)ctx;
+    return (*(const uint32_t *)item & 1) == 0;
+}
+
+// Sets up the filter workload.
+//
+// PARAMS:
+// th    - the pool
+// scale - size factor
+//
+// RETURN:
+// The input, or NULL on error.
+static void *filter_setup(prethd_t *th, size_t scale) {
+    struct array_t *in = histogram_setup(th, scale);
+    if (in == NULL)
+        return NULL;
+    in->out = malloc(in->n * (sizeof *in->out));
+    if (in->out == NULL) {
+        free(in);
+        return NULL;
+    }
+    return in;
+}
+
+// Keeps the even items of a large array.
+//
+// PARAMS:
+// th  - the pool
+// ctx - the input
+static void filter_run(prethd_t *th, void *ctx) {
+    struct array_t *in = ctx;
+    size_t len;
+    prethd_parallel_filter(th, in->data, in->n, sizeof *in->data, even,
+        NULL, in->out, &len);
+}
+
+// Frees the input of the filter workload.
+//
+// PARAMS:
+// ctx - the input
+static void filter_teardown(void *ctx) {
+    struct array_t *in = ctx;
+    free(in->out);
+    free(in);
+}
+
+// Argument of a fib task.
+struct fib_t {
+    prethd_t *pool;             // the pool
+    long n;                     // number to compute
+    long r;                     // result
+};
+
+// Computes a Fibonacci number by spawning one half and recursing on the
+// other.
+static void *fib_task(void *arg) {
+    struct fib_t *f = arg;
+    if (f->n < 2) {
+        f->r = f->n;
+        return NULL;
+    }
+    struct fib_t x = { f->pool, f->n - 1, 0 }, y = { f->pool, f->n - 2, 0 };
+    prethd_frame_t frame;
+    prethd_frame(f->pool, &frame);
+    prethd_spawn(&frame, fib_task, &x);
+    fib_task(&y);
+    prethd_sync(&frame);
+    f->r = x.r + y.r;
+    return NULL;
+}
+
+// Sets up the fib workload.
+//
+// PARAMS:
+// th    - the pool
+// scale - size factor
+//
+// RETURN:
+// The input, or NULL on error.
+static void *fib_setup(prethd_t *th, size_t scale) {
+    struct fib_t *f = malloc(sizeof *f);
+    if (f != NULL) {
+        f->pool = th;
+        f->n = 25 + (long)scale;
+        f->r = 0;
+    }
+    return f;
+}
+
+// Recursive fork-join with spawn and sync.
+//
+// PARAMS:
+// th  - the pool
+// ctx - the input
+static void fib_run(prethd_t *th, void *ctx) {
+    prethd_future_t *fut = prethd_async(th, 0, fib_task, ctx);
+    prethd_future_get(fut, NULL);
+    prethd_future_free(fut);
+}
+
+// Argument of a skiplist task.
+struct skip_arg_t {
+    prethd_skip_t *map;         // the shared map
+    uint64_t seed;              // seed of the task's keys
+};
+
+// Input of the skiplist workload.
+struct skip_in_t {
+    prethd_skip_t *map;         // the shared map
+    size_t n;                   // number of tasks
+    struct skip_arg_t *args;    // arguments of the tasks
+};
+
+// Runs a mix of inserts, finds and erases on the shared map.
+static void *skip_task(void *arg) {
+    struct skip_arg_t *a = arg;
+    prethd_rng_t r;
+    prethd_rng_init(&r, a->seed, 0);
+    for (size_t i = 0; i < 20000; i++) {
+        uint32_t v = prethd_rng_u32(&r);
+        uint64_t key = v % 65536;
+        if (v >> 30 == 0)
+            prethd_skip_insert(a->map, key, NULL);
+        else if (v >> 30 == 1)
+            prethd_skip_erase(a->map, key, NULL);
+        else
+            prethd_skip_find(a->map, key, NULL);
+    }
+    return NULL;
+}
+
+// Sets up the skiplist workload.
+//
+// PARAMS:
+// th    - the pool
+// scale - size factor
+//
+// RETURN:
+// The input, or NULL on error.
+static void *skiplist_setup(prethd_t *th, size_t scale) {
+    size_t n = 64 * scale;
+    struct skip_in_t *in = malloc(sizeof *in + n * (sizeof *in->args));
+    if (in == NULL)
+        return NULL;
+    in->map = prethd_skip_new(th);
+    if (in->map == NULL) {
+        free(in);
+        return NULL;
+    }
+    in->n = n;
+    in->args = (struct skip_arg_t *)(in + 1);
+    for (size_t i = 0; i < n; i++) {
+        in->args[i].map = in->map;
+        in->args[i].seed = i;
+    }
+    return in;
+}
+
+// Concurrent ordered map operations.
+//
+// PARAMS:
+// th  - the pool
+// ctx - the input
+static void skiplist_run(prethd_t *th, void *ctx) {
+    struct skip_in_t *in = ctx;
+    for (size_t i = 0; i < in->n; i++)
+        prethd_submit(th, skip_task, in->args + i);
+    prethd_join(th);
+}
+
+// Frees the input of the skiplist workload.
+//
+// PARAMS:
+// ctx - the input
+static void skiplist_teardown(void *ctx) {
+    struct skip_in_t *in = ctx;
+    prethd_skip_free(in->map);
+    free(in);
+}
+
+// Input of the bfs workload: a graph in compressed sparse row form.
+struct graph_t {
+    size_t nv;                  // number of vertices
+    size_t *offs;               // offset of each vertex's neighbours
+    size_t *adj;                // neighbours of every vertex
+    size_t *dist;               // distances found by the search
+};
+
+// Builds a random undirected graph for the bfs workload.
+//
+// PARAMS:
+// th    - the pool
+// scale - size factor
+//
+// RETURN:
+// The input, or NULL on error.
+static void *bfs_setup(prethd_t *th, size_t scale) {
+    (void)th;
+    size_t nv = 500000 * scale, ne = 4 * nv;
+    struct graph_t *g = malloc(sizeof *g);
+    uint64_t *ends = malloc(ne * (sizeof *ends));
+    if (g == NULL || ends == NULL) {
+        free(g);
+        free(ends);
+        return NULL;
+    }
+    g->nv = nv;
+    g->offs = calloc(nv + 1, sizeof *g->offs);
+    g->adj = malloc(2 * ne * (sizeof *g->adj));
+    g->dist = malloc(nv * (sizeof *g->dist));
+    if (g->offs == NULL || g->adj == NULL || g->dist == NULL) {
+        free(ends);
+        bfs_teardown(g);
+        return NULL;
+    }
+
+    prethd_rng_t r;
+    prethd_rng_init(&r, 7, 0);
+    for (size_t e = 0; e < ne; e++) {
+        ends[e] = prethd_rng_u64(&r);
+        g->offs[(ends[e] >> 32) % nv + 1]++;
+        g->offs[(uint32_t)ends[e] % nv + 1]++;
+    }
+    for (size_t v = 0; v < nv; v++)
+        g->offs[v + 1] += g->offs[v];
+
+    // Fill each list moving its offset to the next one, then shift back.
+    for (size_t e = 0; e < ne; e++) {
+        size_t a = (ends[e] >> 32) % nv, b = (uint32_t)ends[e] % nv;
+        g->adj[g->offs[a]++] = b;
+        g->adj[g->offs[b]++] = a;
+    }
+    for (size_t v = nv; v > 0; v--)
+        g->offs[v] = g->offs[v - 1];
+    g->offs[0] = 0;
+    free(ends);
+    return g;
+}
+
+// Breadth-first search of a random undirected graph.
+//
+// PARAMS:
+// th  - the pool
+// ctx - the graph
+static void bfs_run(prethd_t *th, void *ctx) {
+    struct graph_t *g = ctx;
+    prethd_parallel_bfs(th, g->offs, g->adj, NULL, NULL, g->nv, 0, g->dist);
+}
+
+// Frees the graph of the bfs workload.
+//
+// PARAMS:
+// ctx - the graph
+static void bfs_teardown(void *ctx) {
+    struct graph_t *g = ctx;
+    free(g->offs);
+    free(g->adj);
+    free(g->dist);
+    free(g);
+}
+
+// Returns the time since an arbitrary point in seconds.
+//
+// RETURN:
+// The monotonic time.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Converts a rusage time to seconds.
+//
+// PARAMS:
+// tv - the time
+//
+// RETURN:
+// The time in seconds.
+static double secs(struct timeval tv) {
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+// Lists the CPUs the process may run on with their place in the topology.
+//
+// PARAMS:
+// cpus - receives the CPUs
+//
+// RETURN:
+// The number of CPUs, 0 on error.
+static size_t topology(struct cpu_t *cpus) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) != 0)
+        return 0;
+
+    size_t n = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &set))
+            continue;
+        struct cpu_t *cpu = cpus + n;
+        cpu->id = c;
+        cpu->pkg = read_int(c, "physical_package_id");
+        cpu->core = read_int(c, "core_id");
+        cpu->sib = 0;
+        cpu->crank = 0;
+        for (size_t j = 0; j < n; j++) {
+            if (cpus[j].pkg == cpu->pkg && cpus[j].core == cpu->core)
+                cpu->sib++;
+        }
+        n++;
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            if (cpus[j].pkg == cpus[i].pkg && cpus[j].sib == 0 &&
+                    cpus[j].core < cpus[i].core)
+                cpus[i].crank++;
+        }
+    }
+    return n;
+}
+
+// Reads a number from the sysfs topology of a CPU.
+//
+// PARAMS:
+// cpu  - the CPU
+// file - name of the topology file
+//
+// RETURN:
+// The number, or 0 if it cannot be read.
+static int read_int(int cpu, const char *file) {
+    char path[128];
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/%s",
+        cpu, file);
+    FILE *f = fopen(path, "r");
+    int ret = 0;
+    if (f != NULL) {
+        if (fscanf(f, "%d", &ret) != 1)
+            ret = 0;
+        fclose(f);
+    }
+    return ret;
+}
+
+// Orders CPUs by socket, core and sibling, for qsort().
+static int compact_cmp(const void *a, const void *b) {
+    const struct cpu_t *x = a, *y = b;
+    if (x->pkg != y->pkg)
+        return (x->pkg > y->pkg) - (x->pkg < y->pkg);
+    if (x->crank != y->crank)
+        return (x->crank > y->crank) - (x->crank < y->crank);
+    return (x->sib > y->sib) - (x->sib < y->sib);
+}
+
+// Orders CPUs by sibling, core and socket, for qsort().
+static int scatter_cmp(const void *a, const void *b) {
+    const struct cpu_t *x = a, *y = b;
+    if (x->sib != y->sib)
+        return (x->sib > y->sib) - (x->sib < y->sib);
+    if (x->crank != y->crank)
+        return (x->crank > y->crank) - (x->crank < y->crank);
+    return (x->pkg > y->pkg) - (x->pkg < y->pkg);
+}
+
+// Orders doubles, for qsort().
+static int dbl_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
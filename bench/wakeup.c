@@ -0,0 +1,322 @@
+///////////////////////////////////////////////////////////////////////////////
+// Measures the wake-up latency between two threads of a pool, one-way and
+// round trip, for several ways of parking a thread: the pool's
+// conditional variables, a raw futex, an eventfd, a pipe and spinning.
+// Each is measured with both threads on the same CPU, on sibling
+// hyperthreads, on different cores of a socket and on different sockets,
+// as far as the machine allows. Prints CSV with latencies in microseconds.
+///////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "prethd.h"
+
+// Ways of parking a thread until the other one wakes it.
+enum {
+    MECH_PRETHD,                // prethd_wait() and prethd_signal()
+    MECH_FUTEX,                 // FUTEX_WAIT and FUTEX_WAKE
+    MECH_EVENTFD,               // blocking read() and write() of an eventfd
+    MECH_PIPE,                  // blocking read() and write() of a pipe
+    MECH_SPIN,                  // spinning on a flag
+    MECH_LEN
+};
+
+static const char *mech_names[MECH_LEN] = {
+    "prethd_cond", "futex", "eventfd", "pipe", "spin"
+};
+
+// One direction of the ping-pong.
+struct chan_t {
+    int flag;                   // set by the waker, cleared by the waiter
+    int fds[2];                 // eventfd, or pipe read and write ends
+    double sent;                // time the last wake-up was sent
+};
+
+// The benchmark run by the two threads.
+struct bench_t {
+    prethd_t *pool;             // pool of the two threads
+    int mech;                   // MECH_ value
+    int cpus[2];                // CPU of each thread
+    struct chan_t chans[2];     // to thread 0 and to thread 1
+    size_t iters;               // number of round trips
+    size_t role;                // next role to hand out
+    double *oneway;             // one-way latency samples
+    double *rtt;                // round trip samples
+};
+
+static double now(void);
+static void park(struct bench_t *b, size_t to);
+static void wake(struct bench_t *b, size_t to);
+static void *pingpong(void *arg);
+static int pick_cpu(int cpu0, const char *kind);
+static int read_int(int cpu, const char *file);
+static int dbl_cmp(const void *a, const void *b);
+static void report(const char *mech, const char *place, const char *metric,
+        double *v, size_t n);
+
+int main(int argc, char **argv) {
+    size_t iters = 20000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            fprintf(stderr, "usage: %s [-n round trips]\n", argv[0]);
+            return 1;
+        }
+        iters = strtoul(optarg, NULL, 10);
+    }
+
+    cpu_set_t set;
+    if (iters == 0 || sched_getaffinity(0, sizeof set, &set) != 0)
+        return 1;
+    int cpu0 = 0;
+    while (!CPU_ISSET(cpu0, &set))
+        cpu0++;
+
+    const char *places[] = { "same_cpu", "smt_sibling", "same_socket",
+        "cross_socket" };
+    printf("mechanism,placement,metric,p50_us,p90_us,p99_us,max_us\n");
+    for (size_t p = 0; p < sizeof places / sizeof *places; p++) {
+        int cpu1 = pick_cpu(cpu0, places[p]);
+        if (cpu1 < 0) {
+            fprintf(stderr, "%s: no such CPU pair, skipped\n", places[p]);
+            continue;
+        }
+        for (int m = 0; m < MECH_LEN; m++) {
+            struct bench_t b;
+            memset(&b, 0, sizeof b);
+            b.mech = m;
+            b.cpus[0] = cpu0;
+            b.cpus[1] = cpu1;
+            b.iters = iters;
+            b.oneway = malloc(iters * (sizeof *b.oneway));
+            b.rtt = malloc(iters * (sizeof *b.rtt));
+            b.pool = prethd_new(2, 2, 2);
+            for (size_t c = 0; c < 2; c++) {
+                if (m == MECH_EVENTFD) {
+                    b.chans[c].fds[0] = eventfd(0, 0);
+                    b.chans[c].fds[1] = b.chans[c].fds[0];
+                } else if (m == MECH_PIPE && pipe(b.chans[c].fds) != 0) {
+                    return 1;
+                }
+            }
+            if (b.pool == NULL || b.oneway == NULL || b.rtt == NULL ||
+                    prethd_all(b.pool, pingpong, &b) != 2)
+                return 1;
+            prethd_join(b.pool);
+            prethd_free(b.pool);
+            for (size_t c = 0; c < 2 && m == MECH_EVENTFD; c++)
+                close(b.chans[c].fds[0]);
+            for (size_t c = 0; c < 2 && m == MECH_PIPE; c++) {
+                close(b.chans[c].fds[0]);
+                close(b.chans[c].fds[1]);
+            }
+            report(mech_names[m], places[p], "one_way", b.oneway, iters);
+            report(mech_names[m], places[p], "round_trip", b.rtt, iters);
+            free(b.oneway);
+            free(b.rtt);
+        }
+    }
+    return 0;
+}
+
+// Returns the time since an arbitrary point in seconds.
+//
+// RETURN:
+// The monotonic time.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Parks the calling thread until the other one wakes it.
+//
+// PARAMS:
+// b  - the benchmark
+// to - index of the calling thread
+static void park(struct bench_t *b, size_t to) {
+    struct chan_t *ch = b->chans + to;
+    uint64_t val;
+    switch (b->mech) {
+    case MECH_PRETHD:
+        prethd_lock(b->pool, to);
+        while (!ch->flag)
+            prethd_wait(b->pool, to, to);
+        ch->flag = 0;
+        prethd_unlock(b->pool, to);
+        break;
+    case MECH_FUTEX:
+        while (!__atomic_exchange_n(&ch->flag, 0, __ATOMIC_ACQUIRE))
+            syscall(SYS_futex, &ch->flag, FUTEX_WAIT_PRIVATE, 0, NULL,
+                NULL, 0);
+        break;
+    case MECH_EVENTFD:
+        while (read(ch->fds[0], &val, sizeof val) != sizeof val)
+            ;
+        break;
+    case MECH_PIPE:
+        while (read(ch->fds[0], &val, 1) != 1)
+            ;
+        break;
+    default:
+        while (!__atomic_exchange_n(&ch->flag, 0, __ATOMIC_ACQUIRE))
+            if (b->cpus[0] == b->cpus[1])
+                sched_yield();      // the waker needs this CPU
+        break;
+    }
+}
+
+// Wakes the other thread.
+//
+// PARAMS:
+// b  - the benchmark
+// to - index of the thread to wake
+static void wake(struct bench_t *b, size_t to) {
+    struct chan_t *ch = b->chans + to;
+    uint64_t val = 1;
+    double t = now();
+    __atomic_store(&ch->sent, &t, __ATOMIC_RELAXED);
+    switch (b->mech) {
+    case MECH_PRETHD:
+        prethd_lock(b->pool, to);
+        ch->flag = 1;
+        prethd_signal(b->pool, to);
+        prethd_unlock(b->pool, to);
+        break;
+    case MECH_FUTEX:
+        __atomic_store_n(&ch->flag, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &ch->flag, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        break;
+    case MECH_EVENTFD:
+        while (write(ch->fds[1], &val, sizeof val) != sizeof val)
+            ;
+        break;
+    case MECH_PIPE:
+        while (write(ch->fds[1], &val, 1) != 1)
+            ;
+        break;
+    default:
+        __atomic_store_n(&ch->flag, 1, __ATOMIC_RELEASE);
+        break;
+    }
+}
+
+// Thread of the pool: pins itself, then thread 0 wakes thread 1 and waits
+// to be woken back, iters times, while thread 1 answers every wake-up.
+//
+// PARAMS:
+// arg - the benchmark
+//
+// RETURN:
+// NULL.
+static void *pingpong(void *arg) {
+    struct bench_t *b = arg;
+    size_t me = __atomic_fetch_add(&b->role, 1, __ATOMIC_RELAXED);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(b->cpus[me], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+
+    for (size_t i = 0; i < b->iters; i++) {
+        if (me == 0) {
+            double t = now();
+            wake(b, 1);
+            park(b, 0);
+            b->rtt[i] = now() - t;
+        } else {
+            double t;
+            park(b, 1);
+            __atomic_load(&b->chans[1].sent, &t, __ATOMIC_RELAXED);
+            b->oneway[i] = now() - t;
+            wake(b, 0);
+        }
+    }
+    return NULL;
+}
+
+// Picks a CPU the process may run on, placed relative to another as asked.
+//
+// PARAMS:
+// cpu0 - the other CPU
+// kind - "same_cpu", "smt_sibling", "same_socket" or "cross_socket"
+//
+// RETURN:
+// The CPU, or -1 if there is none.
+static int pick_cpu(int cpu0, const char *kind) {
+    if (strcmp(kind, "same_cpu") == 0)
+        return cpu0;
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) != 0)
+        return -1;
+    int core0 = read_int(cpu0, "core_id");
+    int pkg0 = read_int(cpu0, "physical_package_id");
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (c == cpu0 || !CPU_ISSET(c, &set))
+            continue;
+        int core = read_int(c, "core_id");
+        int pkg = read_int(c, "physical_package_id");
+        if (core < 0 || pkg < 0)
+            continue;
+        if (strcmp(kind, "smt_sibling") == 0 && pkg == pkg0 &&
+                core == core0)
+            return c;
+        if (strcmp(kind, "same_socket") == 0 && pkg == pkg0 &&
+                core != core0)
+            return c;
+        if (strcmp(kind, "cross_socket") == 0 && pkg != pkg0)
+            return c;
+    }
+    return -1;
+}
+
+// Reads a number from the sysfs topology of a CPU.
+//
+// PARAMS:
+// cpu  - the CPU
+// file - name of the topology file
+//
+// RETURN:
+// The number, or -1 on error.
+static int read_int(int cpu, const char *file) {
+    char path[128];
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/%s",
+        cpu, file);
+    FILE *f = fopen(path, "r");
+    int ret = -1;
+    if (f != NULL) {
+        if (fscanf(f, "%d", &ret) != 1)
+            ret = -1;
+        fclose(f);
+    }
+    return ret;
+}
+
+// Orders doubles, for qsort().
+static int dbl_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Prints a CSV row with the percentiles of a set of samples.
+//
+// PARAMS:
+// mech   - name of the mechanism
+// place  - name of the placement
+// metric - name of the samples
+// v      - the samples in seconds, sorted in place
+// n      - number of samples
+static void report(const char *mech, const char *place, const char *metric,
+        double *v, size_t n) {
+    qsort(v, n, sizeof *v, dbl_cmp);
+    printf("%s,%s,%s,%.2f,%.2f,%.2f,%.2f\n", mech, place, metric,
+        v[n / 2] * 1e6, v[n * 9 / 10] * 1e6, v[n * 99 / 100] * 1e6,
+        v[n - 1] * 1e6);
+}
@@ -3,8 +3,317 @@
 // https://github.com/PotatoMaster101/prethread
 ///////////////////////////////////////////////////////////////////////////////
 
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/mman.h>
 #include "prethd.h"
 
+// Task waiting in the queue of a pool. Tasks submitted with
+// prethd_submit_copy() carry their data right after the task.
+struct task_t {
+    void *(*func)(void *);      // function to run
+    void *arg;                  // argument for the function
+    struct task_t *next;        // next task in the queue
+    size_t size;                // size of the data after the task
+    size_t tid;                 // trace id, 0 if not traced
+    uint64_t tag;               // accounting tag
+};
+
+// Header of a task record in a spill file, followed by the task data.
+struct spill_rec_t {
+    void *(*func)(void *);      // function to run
+    void *arg;                  // argument for the function, if no data
+    size_t size;                // size of the data after the record
+    size_t tid;                 // trace id, 0 if not traced
+    uint64_t tag;               // accounting tag
+};
+
+// Traced task, see prethd_trace().
+struct trace_node_t {
+    size_t parent;              // trace id of the task that queued it, or 0
+    double spawn;               // time the task was queued
+    double start;               // time the task started
+    double end;                 // time the task returned
+    double nest;                // time in nested tasks and prethd_sync()
+};
+
+// Dependency between two traced tasks added with prethd_trace_edge().
+struct trace_edge_t {
+    size_t from;                // trace id of the task depended on
+    size_t to;                  // trace id of the dependent task
+};
+
+// Alignment of the records in a spill file.
+#define SPILL_ALIGN 16
+
+// Maximum height of a skiplist entry.
+#define SKIP_LEVELS 24
+
+// Memory retired while other threads may still be reading it, freed once
+// the reclamation epoch has moved on twice.
+struct ebr_node_t {
+    struct ebr_node_t *next;    // next retired node
+    size_t tag;                 // epoch the node was retired in
+    void (*free)(void *);       // frees the node
+};
+
+// Skiplist entry. Links are tagged pointers whose low bit marks the entry
+// as removed, and refs counts the levels it is linked at, so that the
+// thread unlinking it from the last one retires it.
+struct skip_node_t {
+    struct ebr_node_t rn;       // retired node, must be first
+    uint64_t key;               // key of the entry
+    void *val;                  // value of the entry
+    size_t height;              // number of levels
+    size_t refs;                // levels linked, plus one while inserting
+    uintptr_t next[];           // next entry at each level, low bit marked
+};
+
+// Bounded queue of prethd_bqueue_new().
+struct prethd_bqueue_t {
+    prethd_t *pool;             // the pool owning the sync objects
+    void **items;               // ring of queued items
+    size_t cap;                 // capacity of the ring
+    size_t head;                // ring index of the oldest item
+    size_t len;                 // number of queued items
+    size_t m;                   // mutex index guarding the queue
+    size_t ne;                  // conditional variable index of consumers
+    size_t nf;                  // conditional variable index of producers
+    size_t cwait;               // consumers waiting
+    size_t pwait;               // producers waiting
+    _Bool closed;               // no more items are accepted
+};
+
+// Ordered map of prethd_skip_new().
+struct prethd_skip_t {
+    prethd_t *pool;             // the pool reclaiming removed entries
+    uint64_t seed;              // seed of the entry heights
+    struct skip_node_t *head;   // sentinel entry, SKIP_LEVELS high
+};
+
+// Slot in the signal ring. The sequence number tells producers and
+// consumers whose turn it is to use the slot.
+struct sig_slot_t {
+    size_t seq;                 // slot sequence number
+    void *(*func)(void *);      // function to run
+    void *arg;                  // argument for the function
+};
+
+// Executor class: a range of threads in the pool with their own task
+// queue, so that tasks of one class never hold up the threads of another.
+struct exec_t {
+    char *name;                 // class name
+    size_t first;               // index of the first thread in the class
+    size_t len;                 // number of threads in the class
+    pthread_mutex_t qmut;       // mutex guarding the task queue
+    sem_t qsem;                 // posted once for every task queued
+    struct task_t *qhead;       // first task in the queue
+    struct task_t *qtail;       // last task in the queue
+    size_t qlen;                // number of tasks in the queue
+    unsigned char *smap;        // mapped spill file, or NULL
+    int sfd;                    // descriptor of the spill file, or -1
+    size_t scap;                // size of the spill file
+    size_t shead;               // offset of the first spilled record
+    size_t stail;               // offset past the last spilled record
+    size_t swrap;               // end of the records before stail wrapped
+    size_t slen;                // number of spilled records
+    struct task_t *ohead;       // first task held back, the file was full
+    struct task_t *otail;       // last task held back
+    size_t olen;                // number of tasks held back
+    size_t hiwat;               // queue length from which tasks spill
+    size_t cmax;                // most tasks coalesced per entry, or 0
+    size_t idle;                // threads waiting for a task, if shared
+};
+
+// Task coalesced into a batch.
+struct batch_item_t {
+    void *(*func)(void *);      // function to run
+    void *arg;                  // argument for the function
+};
+
+// Tasks coalesced into one queue entry by prethd_submit_to(), kept as the
+// payload of the entry.
+struct batch_t {
+    pthread_t owner;            // thread that queued the tasks
+    size_t len;                 // number of tasks
+    size_t cap;                 // capacity of tasks
+    struct batch_item_t tasks[];    // the tasks, in submission order
+};
+
+// Counting semaphore of a pool. Bulkhead tasks that find no permit are
+// parked here instead of blocking a thread, and are queued again as
+// permits are released.
+struct psem_t {
+    sem_t sem;                  // the semaphore
+    pthread_mutex_t bmut;       // mutex guarding the parked tasks
+    struct bulk_t *phead;       // first parked bulkhead task
+    struct bulk_t *ptail;       // last parked bulkhead task
+    size_t plen;                // number of parked bulkhead tasks
+};
+
+// Task submitted with prethd_submit_bulkhead().
+struct bulk_t {
+    prethd_t *pool;             // the pool running the task
+    size_t c;                   // executor class to queue the task in
+    size_t s;                   // semaphore index limiting the task
+    _Bool held;                 // a permit was handed over to the task
+    void *(*func)(void *);      // function to run
+    void *arg;                  // argument for the function
+    struct bulk_t *next;        // next parked task
+};
+
+// Loop run in parallel by par_run(): the caller and the helper tasks it
+// queues take indices until all are done. Freed by the last one out.
+struct par_t {
+    void (*fn)(void *ctx, size_t i);    // body of the loop
+    void *ctx;                  // argument for the body
+    size_t n;                   // number of indices
+    size_t next;                // next index to take
+    size_t done;                // number of indices done
+    size_t refs;                // caller and helpers still using the loop
+    pthread_mutex_t mut;        // mutex for waiting on the loop
+    pthread_cond_t cond;        // signalled once all indices are done
+};
+
+// Per-thread table of prethd_parallel_groupby().
+struct group_tab_t {
+    prethd_group_t *slots;      // open addressing slots
+    _Bool *used;                // whether each slot is used
+    size_t cap;                 // number of slots, a power of two
+    size_t len;                 // number of groups
+};
+
+// Per-thread table of CPU time by tag, see prethd_account().
+struct usage_tab_t {
+    prethd_usage_t *slots;      // open addressing slots
+    _Bool *used;                // whether each slot is used
+    size_t cap;                 // number of slots, a power of two
+    size_t len;                 // number of tags
+};
+
+// Arguments of the histogram and group-by kernels.
+struct agg_t {
+    const unsigned char *data;  // items to bin, or keys to group
+    const double *vals;         // values to add up by group
+    size_t n;                   // number of items
+    size_t size;                // size of each item
+    size_t (*bin)(const void *item, void *ctx);     // bin of an item
+    void *ctx;                  // argument for bin
+    size_t *counts;             // per-chunk bin counts
+    size_t nbins;               // number of bins
+    struct group_tab_t *tabs;   // per-chunk group tables
+    size_t k;                   // number of chunks
+    size_t stride;              // chunk distance of the merge level
+    _Bool err;                  // a table could not grow
+    _Bool (*pred)(const void *item, void *ctx);     // filter predicate
+    unsigned char *out;         // filtered or partitioned items
+    size_t kept;                // number of items matching pred
+    _Bool rest;                 // items not matching pred are copied too
+};
+
+// Per-chunk buffer of prethd_parallel_bfs().
+struct bfs_buf_t {
+    size_t *v;                  // vertices found top-down
+    size_t len;                 // number of vertices found
+    size_t cap;                 // capacity of v
+    size_t edges;               // out-edges of the vertices found
+};
+
+// State of prethd_parallel_bfs().
+struct bfs_t {
+    const size_t *offs;         // out-edge offsets
+    const size_t *adj;          // out-neighbours
+    const size_t *roffs;        // in-edge offsets
+    const size_t *radj;         // in-neighbours
+    size_t nv;                  // number of vertices
+    size_t nw;                  // number of bitmap words
+    size_t *dist;               // distance of each vertex
+    size_t level;               // distance of the frontier
+    size_t *front;              // frontier as a vertex list
+    size_t flen;                // number of vertices in the frontier
+    size_t *nfront;             // next frontier as a vertex list
+    uint64_t *bits;             // frontier as a bitmap
+    uint64_t *nbits;            // next frontier as a bitmap
+    struct bfs_buf_t *bufs;     // per-chunk buffers
+    size_t k;                   // number of chunks
+    _Bool err;                  // a buffer could not grow
+};
+
+// States of a future.
+enum {
+    FUT_PENDING,                // queued, not started
+    FUT_RUNNING,                // function running
+    FUT_DONE,                   // function returned
+    FUT_CANCELLED               // cancelled before it started
+};
+
+// Thread waiting on one or more futures in fut_wait().
+struct fut_wait_t {
+    pthread_mutex_t mut;        // mutex for waiting on the futures
+    pthread_cond_t cond;        // broadcast when one of them finishes
+};
+
+// Link of a waiting thread into the waiter list of one future.
+struct fut_link_t {
+    struct fut_wait_t *w;       // the waiting thread
+    struct fut_link_t *next;    // next waiter of the future
+};
+
+// Result of a task queued with prethd_async().
+struct prethd_future_t {
+    prethd_t *pool;             // the pool running the task
+    void *(*func)(void *);      // function to run
+    void *arg;                  // argument for the function
+    void *ret;                  // value returned by the function
+    int state;                  // FUT_ state
+    _Bool cancel;               // cancelled while running
+    size_t refs;                // the queued task and the caller
+    pthread_mutex_t mut;        // mutex guarding the waiter list
+    struct fut_link_t *waiters; // threads waiting on the future
+};
+
+// Subtask queued by prethd_spawn() in the deque of the spawning thread.
+struct spawn_t {
+    void *(*func)(void *);      // function to run
+    void *arg;                  // argument for the function
+    prethd_frame_t *frame;      // frame of the spawning task
+    size_t tid;                 // trace id, 0 if not traced
+    uint64_t tag;               // accounting tag of the spawning task
+};
+
+// Per-thread state of a pool thread running the task loop.
+struct worker_t {
+    prethd_t *pool;             // the pool the thread belongs to
+    struct exec_t *exec;        // the executor class the thread serves
+    size_t id;                  // index of the thread in the pool
+    void **res;                 // the thread's per-thread resources
+    size_t tid;                 // trace id of the running task, or 0
+    double tnest;               // time the running traced task was nested
+    uint64_t tag;               // accounting tag of the running task
+    prethd_future_t *fut;       // future of the running task, or NULL
+    prethd_rng_t rng;           // the thread's random stream
+    uint64_t hctr;              // counter of the skiplist entry heights
+    struct spawn_t *dq;         // spawned subtasks, oldest at dtop
+    size_t dtop;                // next subtask to steal
+    size_t dbot;                // one past the newest subtask
+    size_t dcap;                // capacity of dq
+    pthread_mutex_t dmut;       // mutex guarding the deque
+    size_t epoch;               // announced epoch times two plus one, or 0
+    size_t edepth;              // nesting of reclamation critical sections
+    struct usage_tab_t atab;    // time used by the thread's tasks, by tag
+    pthread_mutex_t amut;       // mutex guarding atab
+    double acpu;                // CPU time of tasks run inside the current
+    double awall;               // wall time of tasks run inside the current
+};
+
 // Pre-allocated threads.
 struct pre_threads_t {
     pthread_mutex_t *muts;      // list of mutexes for locking
@@ -13,12 +322,167 @@ struct pre_threads_t {
     size_t len;                 // number of threads
     size_t mlen;                // number of mutexes
     size_t clen;                // number of conditional variables
+    struct psem_t *sems;        // list of counting semaphores
+    size_t slen;                // number of semaphores
+    size_t run;                 // number of threads started
+    void *(*func)(void *);      // function given to the last prethd_all()
+    void *arg;                  // argument given to the last prethd_all()
+    _Bool forked;               // pool was inherited across fork()
+    prethd_t *next;             // next pool in the fork registry
+    _Bool share;                // lends and borrows idle threads
+    _Bool tasks;                // threads run the task loop
+    _Bool stop;                 // task loop stops once the queue is empty
+    _Bool cancel;               // queued tasks are dropped, none accepted
+    _Bool abort;                // running tasks are asked to return early
+    size_t live;                // number of task loop threads not exited
+    size_t lent;                // tasks running on threads of other pools
+    struct usage_tab_t ltab;    // time used by lent tasks, by tag
+    pthread_mutex_t lmut;       // mutex guarding ltab
+    pthread_mutex_t xmut;       // mutex guarding live
+    pthread_cond_t xcond;       // signalled when the last thread exits
+    struct exec_t *execs;       // executor classes, the first is the default
+    size_t elen;                // number of executor classes
+    struct worker_t *workers;   // per-thread state of the task loop
+    prethd_res_t *res;          // per-thread resource callbacks
+    size_t reslen;              // number of per-thread resources
+    void **resv;                // per-thread resources of all threads
+    uint64_t seed;              // seed of the per-thread random streams
+    int *cpus;                  // CPUs to pin the threads to, or NULL
+    size_t ncpus;               // number of CPUs to pin to
+    size_t stack;               // stack size of the threads, 0 for default
+    size_t guard;               // guard size, SIZE_MAX for default
+    _Bool trace;                // tasks are traced
+    _Bool acct;                 // task CPU time is accounted by tag
+    pthread_mutex_t tmut;       // mutex guarding the trace
+    struct trace_node_t *tnodes;    // traced tasks, by trace id minus one
+    size_t tlen;                // number of traced tasks
+    size_t tcap;                // capacity of the traced tasks
+    struct trace_edge_t *tedges;    // dependencies between traced tasks
+    size_t telen;               // number of dependencies
+    size_t tecap;               // capacity of the dependencies
+    struct sig_slot_t *ring;    // tasks submitted from signal handlers
+    size_t rmask;               // signal ring size minus one
+    size_t rhead;               // next signal ring slot to pop
+    size_t rtail;               // next signal ring slot to push
+    size_t epoch;               // reclamation epoch
+    size_t eout[3];             // threads outside the pool in each epoch
+    struct ebr_node_t *limbo[3];    // retired nodes, by epoch mod 3
+    size_t epend;               // nodes retired since the last advance
 };
 
+// Every live pool, so the atfork handlers can reach their sync objects
+// and sharing pools can find each other.
+static pthread_mutex_t reg_mut = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t reg_once = PTHREAD_ONCE_INIT;
+static prethd_t *reg_head = NULL;
+
+// Number of threads of sharing pools waiting for a task.
+static size_t share_idle = 0;
+
+// Process-wide default pool, see prethd_default(). The mutex guards its
+// restart in a child process.
+static pthread_once_t def_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t def_mut = PTHREAD_MUTEX_INITIALIZER;
+static prethd_t *def_pool = NULL;
+
+// Worker state of the calling thread, set by the task loop.
+static pthread_key_t self_key;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
 static pthread_mutex_t *init_muts(size_t n);
 static void des_muts(pthread_mutex_t *muts, size_t n);
 static pthread_cond_t *init_conds(size_t n);
 static void des_conds(pthread_cond_t *conds, size_t n);
+static struct psem_t *init_sems(const unsigned *values, size_t n);
+static void des_sems(struct psem_t *sems, size_t n);
+static struct exec_t *init_execs(const char **names, const size_t *sizes,
+        size_t n);
+static void des_execs(struct exec_t *execs, size_t n);
+static void des_pool(prethd_t *th);
+static void drop_tasks(prethd_t *th);
+static void def_init(void);
+static void def_exit(void);
+static void self_init(void);
+static struct worker_t *self_get(prethd_t *th);
+static struct worker_t *self_any(void);
+static int thd_create(prethd_t *th, size_t i, void *(*func)(void *),
+        void *arg);
+static void *task_loop(void *arg);
+static _Bool task_next(prethd_t *th, struct worker_t *w);
+static void task_run(prethd_t *th, struct worker_t *w, struct task_t *t);
+static void task_exec(prethd_t *th, struct worker_t *w, struct task_t *t);
+static void task_drop(void *(*func)(void *), void *arg);
+static _Bool spawn_steal(prethd_t *th, struct worker_t *w);
+static void spawn_run(prethd_t *th, struct worker_t *w, struct spawn_t *sp);
+static void share_wait(prethd_t *th, struct worker_t *w);
+static struct task_t *share_take(prethd_t *th, prethd_t **from);
+static void share_return(prethd_t *th);
+static void share_wake(prethd_t *th);
+static void bq_wake(pthread_cond_t *cond, size_t waiting, size_t k);
+static size_t ebr_enter(prethd_t *th);
+static void ebr_exit(prethd_t *th, size_t e);
+static void ebr_retire(prethd_t *th, struct ebr_node_t *n);
+static void ebr_advance(prethd_t *th);
+static _Bool skip_search(prethd_skip_t *s, uint64_t key,
+        struct skip_node_t **preds, struct skip_node_t **succs);
+static size_t skip_height(prethd_skip_t *s, uint64_t key);
+static void skip_drop(prethd_skip_t *s, struct skip_node_t *n);
+static size_t trace_add(prethd_t *th, struct worker_t *w);
+static double trace_time(prethd_t *th, size_t tid, _Bool start,
+        double nest);
+static int trace_cmp(const void *a, const void *b);
+static double now(void);
+static double cpu_now(void);
+static void usage_add(struct usage_tab_t *tab, pthread_mutex_t *mut,
+        uint64_t tag, double cpu, double wall);
+static int usage_cmp(const void *a, const void *b);
+static void res_clear(prethd_t *th, struct worker_t *w);
+static _Bool task_submit(prethd_t *th, size_t c, void *(*func)(void *),
+        void *arg);
+static _Bool task_push(prethd_t *th, size_t c, struct task_t *t);
+static struct task_t *task_pop(struct exec_t *ex);
+static _Bool spill_put(struct exec_t *ex, struct task_t *t);
+static void spill_get(struct exec_t *ex, size_t upto);
+static void spill_flush(struct exec_t *ex);
+static void spill_close(struct exec_t *ex);
+static _Bool par_run(prethd_t *th, size_t n, void (*fn)(void *, size_t),
+        void *ctx);
+static void *par_help(void *arg);
+static void par_loop(struct par_t *par);
+static void par_put(struct par_t *par);
+static void hist_chunk(void *ctx, size_t i);
+static void hist_merge(void *ctx, size_t i);
+static _Bool part_run(prethd_t *th, const void *data, size_t n, size_t size,
+        _Bool (*pred)(const void *item, void *ctx), void *ctx, void *out,
+        size_t *len, _Bool rest);
+static void part_count(void *ctx, size_t i);
+static void part_scatter(void *ctx, size_t i);
+static void bfs_down(void *ctx, size_t i);
+static void bfs_up(void *ctx, size_t i);
+static void bfs_gather(void *ctx, size_t i);
+static void bfs_pack(void *ctx, size_t i);
+static void bfs_unpack(void *ctx, size_t i);
+static void group_chunk(void *ctx, size_t i);
+static void group_merge(void *ctx, size_t i);
+static _Bool group_add(struct group_tab_t *tab, const prethd_group_t *g);
+static void group_free(struct group_tab_t *tab);
+static int group_cmp(const void *a, const void *b);
+static void rng_block(const prethd_rng_t *r, uint64_t ctr, uint32_t *out);
+static void *fut_run(void *arg);
+static void fut_finish(prethd_future_t *f, int state);
+static _Bool fut_wait(prethd_future_t **futs, size_t n, _Bool any);
+static _Bool fut_ready(prethd_future_t **futs, size_t n, _Bool any);
+static void *bulk_run(void *arg);
+static void *batch_run(void *arg);
+static void bulk_drain(prethd_t *th, struct psem_t *ps);
+static _Bool ring_push(prethd_t *th, void *(*func)(void *), void *arg);
+static _Bool ring_pop(prethd_t *th, struct task_t *t);
+static void reg_add(prethd_t *th);
+static void reg_del(prethd_t *th);
+static void reg_atfork(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
 
 // Allocate a new pool of threads.
 //
@@ -38,19 +502,118 @@ prethd_t *prethd_new(size_t th, size_t mut, size_t cond) {
         ret->len = th;
         ret->mlen = mut;
         ret->clen = cond;
+        ret->sems = NULL;
+        ret->slen = 0;
+        ret->run = 0;
+        ret->func = NULL;
+        ret->arg = NULL;
+        ret->forked = false;
+        ret->tasks = false;
+        ret->share = false;
+        ret->lent = 0;
+        ret->ltab.slots = NULL;
+        ret->ltab.used = NULL;
+        ret->ltab.cap = 0;
+        ret->ltab.len = 0;
+        pthread_mutex_init(&ret->lmut, NULL);
+        ret->stop = false;
+        ret->cancel = false;
+        ret->abort = false;
+        ret->live = 0;
+        pthread_mutex_init(&ret->xmut, NULL);
+        pthread_cond_init(&ret->xcond, NULL);
+        ret->ring = NULL;
+        ret->rmask = 0;
+        ret->rhead = 0;
+        ret->rtail = 0;
+        ret->epoch = 0;
+        ret->epend = 0;
+        for (size_t i = 0; i < 3; i++) {
+            ret->eout[i] = 0;
+            ret->limbo[i] = NULL;
+        }
+        ret->res = NULL;
+        ret->reslen = 0;
+        ret->resv = NULL;
+        ret->cpus = NULL;
+        ret->ncpus = 0;
+        ret->stack = 0;
+        ret->guard = SIZE_MAX;
+        ret->seed = 0;
+        ret->trace = false;
+        ret->acct = false;
+        ret->tnodes = NULL;
+        ret->tlen = 0;
+        ret->tcap = 0;
+        ret->tedges = NULL;
+        ret->telen = 0;
+        ret->tecap = 0;
+        pthread_mutex_init(&ret->tmut, NULL);
+        ret->elen = 1;
+        ret->execs = init_execs(NULL, &th, 1);
+        ret->workers = malloc(th * (sizeof *ret->workers));
+        for (size_t i = 0; ret->workers != NULL && i < th; i++) {
+            ret->workers[i].dq = NULL;
+            ret->workers[i].dtop = 0;
+            ret->workers[i].dbot = 0;
+            ret->workers[i].dcap = 0;
+            ret->workers[i].epoch = 0;
+            ret->workers[i].edepth = 0;
+            ret->workers[i].atab.slots = NULL;
+            ret->workers[i].atab.used = NULL;
+            ret->workers[i].atab.cap = 0;
+            ret->workers[i].atab.len = 0;
+            ret->workers[i].acpu = 0;
+            ret->workers[i].awall = 0;
+            pthread_mutex_init(&ret->workers[i].amut, NULL);
+            pthread_mutex_init(&ret->workers[i].dmut, NULL);
+        }
         ret->muts = init_muts(mut);
         ret->conds = init_conds(cond);
         ret->threads = malloc(th * sizeof(pthread_t));
-        if (ret->threads == NULL) {
+        if (ret->threads == NULL || ret->execs == NULL ||
+                ret->workers == NULL) {
             des_muts(ret->muts, mut);
             des_conds(ret->conds, cond);
+            des_execs(ret->execs, ret->elen);
+            pthread_mutex_destroy(&ret->tmut);
+            pthread_mutex_destroy(&ret->lmut);
+            pthread_mutex_destroy(&ret->xmut);
+            pthread_cond_destroy(&ret->xcond);
+            for (size_t i = 0; ret->workers != NULL && i < th; i++) {
+                pthread_mutex_destroy(&ret->workers[i].dmut);
+                pthread_mutex_destroy(&ret->workers[i].amut);
+            }
+            free(ret->workers);
+            free(ret->threads);
             free(ret);
             ret = NULL;
+        } else {
+            reg_add(ret);
         }
     }
     return ret;
 }
 
+// Returns the process-wide default pool, creating and starting it on
+// first use. It has one thread per CPU the process may run on, so
+// libraries sharing it do not oversubscribe the machine, and it is joined
+// and freed at exit(). In a child process it is restarted on first use.
+//
+// RETURN:
+// The default pool, or NULL on error.
+prethd_t *prethd_default(void) {
+    pthread_once(&def_once, def_init);
+    prethd_t *th = def_pool;
+    if (th != NULL && __atomic_load_n(&th->forked, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&def_mut);
+        if (th->forked)
+            prethd_respawn(th);
+        pthread_mutex_unlock(&def_mut);
+    }
+    return th;
+}
+
 // Starts all the threads in the given thread pool.
 //
 // PARAMS:
@@ -61,220 +624,4429 @@ prethd_t *prethd_new(size_t th, size_t mut, size_t cond) {
 // RETURN:
 // The number of threads started, 0 on error.
 size_t prethd_all(prethd_t *th, void *(*func)(void *), void *arg) {
-    if (th == NULL)
+    if (th == NULL || th->run > 0)
         return 0;
 
     size_t ret = 0;
     for (size_t i = 0; i < th->len; i++) {
-        if (pthread_create(&(th->threads[i]), NULL, func, arg) != 0)
+        if (thd_create(th, i, func, arg) != 0)
             break;      // pthread_create() error
         ret++;
     }
+    th->func = func;
+    th->arg = arg;
+    th->run = ret;
     return ret;
 }
 
-// Returns the number of threads in the thread pool.
+// Starts all the threads in the given thread pool running its task loop.
+// Tasks are then handed to the threads with prethd_submit() and
+// prethd_submit_from_signal(), and run in submission order.
 //
 // PARAMS:
-// th - the thread pool to retrieve the size
+// th - the thread pool to start
 //
 // RETURN:
-// The thread pool size, or 0 on error.
-size_t prethd_size(prethd_t *th) {
-    return (th == NULL) ? 0 : th->len;
+// The number of threads started, 0 on error.
+size_t prethd_start(prethd_t *th) {
+    if (th == NULL || th->run > 0)
+        return 0;
+
+    pthread_once(&self_once, self_init);
+    size_t ret = 0;
+    struct exec_t *ex = th->execs;
+    for (size_t i = 0; i < th->len; i++) {
+        if (i >= ex->first + ex->len)
+            ex++;
+        th->workers[i].pool = th;
+        th->workers[i].exec = ex;
+        th->workers[i].id = i;
+        th->workers[i].res = (th->resv == NULL) ? NULL :
+            th->resv + i * th->reslen;
+        th->workers[i].tid = 0;
+        th->workers[i].tnest = 0;
+        th->workers[i].tag = 0;
+        th->workers[i].fut = NULL;
+        prethd_rng_init(&th->workers[i].rng, th->seed, i);
+        th->workers[i].hctr = (uint64_t)i << 40;
+        res_clear(th, th->workers + i);     // left over from before fork()
+        if (thd_create(th, i, task_loop, th->workers + i) != 0)
+            break;      // pthread_create() error
+        ret++;
+    }
+    th->func = NULL;
+    th->arg = NULL;
+    __atomic_store_n(&th->tasks, ret > 0, __ATOMIC_RELEASE);
+    th->live = ret;
+    th->run = ret;
+    return ret;
 }
 
-// Returns the number of mutexes in the thread pool.
+// Pins the threads of the given thread pool to CPUs: thread i runs on
+// cpus[i % n]. Must be called before prethd_all() or prethd_start().
 //
 // PARAMS:
-// th - the thread pool to retrieve the size
+// th   - the thread pool to pin
+// cpus - CPU of each thread, or NULL to let them run anywhere
+// n    - number of CPUs given
 //
 // RETURN:
-// The thread pool mutex size, or 0 on error.
-size_t prethd_mutex_size(prethd_t *th) {
-    return (th == NULL) ? 0 : th->mlen;
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_affinity(prethd_t *th, const int *cpus, size_t n) {
+    if (th == NULL || th->run > 0 || (cpus == NULL && n > 0))
+        return false;
+
+    int *copy = NULL;
+    if (n > 0) {
+        copy = malloc(n * (sizeof *copy));
+        if (copy == NULL)
+            return false;
+        memcpy(copy, cpus, n * (sizeof *copy));
+    }
+    free(th->cpus);
+    th->cpus = copy;
+    th->ncpus = n;
+    return true;
 }
 
-// Returns the number of conditional variables in the thread pool.
+// Sets the stack of the threads of the given thread pool. Smaller stacks
+// let a process run many more threads, as each thread reserves its whole
+// stack of address space and commits the pages it touches. Must be called
+// before prethd_all() or prethd_start().
 //
 // PARAMS:
-// th - the thread pool to retrieve the size
+// th    - the thread pool to configure
+// size  - stack size in bytes, at least PTHREAD_STACK_MIN, or 0 for the
+//         system default
+// guard - guard size in bytes below the stack, or SIZE_MAX for the system
+//         default
 //
 // RETURN:
-// The thread pool conditional variable size, or 0 on error.
-size_t prethd_cond_size(prethd_t *th) {
-    return (th == NULL) ? 0 : th->clen;
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_stack(prethd_t *th, size_t size, size_t guard) {
+    if (th == NULL || th->run > 0 ||
+            (size > 0 && size < (size_t)PTHREAD_STACK_MIN))
+        return false;
+
+    th->stack = size;
+    th->guard = guard;
+    return true;
 }
 
-// Joins all threads in the thread pool.
+// Splits the threads of the given thread pool into executor classes, each
+// with its own task queue, e.g. one class for CPU bound tasks and one for
+// blocking I/O. Threads are assigned to the classes in order. Must be
+// called before prethd_start().
 //
 // PARAMS:
-// th - the thread pool to join
+// th    - the thread pool to split
+// names - name of each class
+// sizes - number of threads in each class, adding up to the pool size
+// n     - number of classes
 //
 // RETURN:
 // 1 (true) on success, 0 (false) on error.
-_Bool prethd_join(prethd_t *th) {
-    if (th == NULL)
+_Bool prethd_classes(prethd_t *th, const char **names, const size_t *sizes,
+        size_t n) {
+    if (th == NULL || names == NULL || sizes == NULL || n == 0 ||
+            th->run > 0)
         return false;
 
-    int chk = 0;
-    for (size_t i = 0; i < th->len; i++)
-        chk += pthread_join(th->threads[i], NULL);
-    return chk == 0;
+    size_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (sizes[i] == 0 || names[i] == NULL)
+            return false;
+        sum += sizes[i];
+    }
+    if (sum != th->len)
+        return false;
+
+    struct exec_t *execs = init_execs(names, sizes, n);
+    if (execs == NULL)
+        return false;
+    des_execs(th->execs, th->elen);
+    th->execs = execs;
+    th->elen = n;
+    return true;
 }
 
-// Locks the given thread pool.
+// Returns the number of executor classes in the thread pool.
 //
 // PARAMS:
-// th - the thread pool to lock
-// i  - the index of mutex to lock
+// th - the thread pool to retrieve the size
+//
+// RETURN:
+// The thread pool executor class size, or 0 on error.
+size_t prethd_class_size(prethd_t *th) {
+    return (th == NULL) ? 0 : th->elen;
+}
+
+// Returns the name of an executor class in the thread pool.
+//
+// PARAMS:
+// th - the thread pool to retrieve the name
+// c  - the executor class index
+//
+// RETURN:
+// The executor class name, or NULL on error.
+const char *prethd_class_name(prethd_t *th, size_t c) {
+    return (th == NULL || c >= th->elen) ? NULL : th->execs[c].name;
+}
+
+// Registers per-thread resources of the thread pool, such as file
+// descriptors or parser states. Each thread running the task loop creates
+// its own instance of a resource the first time it asks for it with
+// prethd_resource(), and destroys it when it exits. Must be called before
+// prethd_start().
+//
+// PARAMS:
+// th  - the thread pool to register the resources for
+// res - callbacks of each resource
+// n   - number of resources
 //
 // RETURN:
 // 1 (true) on success, 0 (false) on error.
-_Bool prethd_lock(prethd_t *th, size_t i) {
-    return (th == NULL || i >= th->mlen) ? false :
-        pthread_mutex_lock(th->muts + i) == 0;
+_Bool prethd_resources(prethd_t *th, const prethd_res_t *res, size_t n) {
+    if (th == NULL || res == NULL || n == 0 || th->res != NULL ||
+            th->run > 0)
+        return false;
+
+    for (size_t i = 0; i < n; i++)
+        if (res[i].create == NULL)
+            return false;
+    th->res = malloc(n * (sizeof *th->res));
+    th->resv = calloc(th->len * n, sizeof *th->resv);
+    if (th->res == NULL || th->resv == NULL) {
+        free(th->res);
+        free(th->resv);
+        th->res = NULL;
+        th->resv = NULL;
+        return false;
+    }
+    memcpy(th->res, res, n * (sizeof *th->res));
+    th->reslen = n;
+    return true;
 }
 
-// Unocks the given thread pool.
+// Returns the calling thread's instance of a per-thread resource, creating
+// it on first use. Does not lock; only threads running the task loop of
+// the pool have instances.
 //
 // PARAMS:
-// th - the thread pool to unlock
-// i  - the index of mutex to unlock
+// th - the thread pool the resource is registered with
+// i  - the index of the resource
+//
+// RETURN:
+// The resource instance, or NULL on error.
+void *prethd_resource(prethd_t *th, size_t i) {
+    if (th == NULL || i >= th->reslen)
+        return NULL;
+
+    struct worker_t *w = self_get(th);
+    if (w == NULL)
+        return NULL;
+    if (w->res[i] == NULL)
+        w->res[i] = th->res[i].create(th->res[i].ctx);
+    return w->res[i];
+}
+
+// Queues a task for the threads of a started pool. The task goes to the
+// first executor class.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// func - function to run
+// arg  - argument for the function
 //
 // RETURN:
 // 1 (true) on success, 0 (false) on error.
-_Bool prethd_unlock(prethd_t *th, size_t i) {
-    return (th == NULL || i >= th->mlen) ? false :
-        pthread_mutex_unlock(th->muts + i) == 0;
+_Bool prethd_submit(prethd_t *th, void *(*func)(void *), void *arg) {
+    return prethd_submit_to(th, 0, func, arg);
 }
 
-// Make the given thread pool wait on the conditional variable.
+// Queues a task for the threads of an executor class in a started pool.
 //
 // PARAMS:
-// th - the thread pool to wait
-// c  - the conditional variable index to wait
-// m  - the mutex index to use
+// th   - the thread pool to run the task
+// c    - the executor class index
+// func - function to run
+// arg  - argument for the function
 //
 // RETURN:
 // 1 (true) on success, 0 (false) on error.
-_Bool prethd_wait(prethd_t *th, size_t c, size_t m) {
-    return (th == NULL || c >= th->clen || m >= th->mlen) ? false :
-        pthread_cond_wait(th->conds + c, th->muts + m) == 0;
+_Bool prethd_submit_to(prethd_t *th, size_t c, void *(*func)(void *),
+        void *arg) {
+    if (th == NULL || c >= th->elen || func == NULL)
+        return false;
+
+    struct exec_t *ex = th->execs + c;
+    size_t cmax = __atomic_load_n(&ex->cmax, __ATOMIC_RELAXED);
+    if (cmax == 0 || __atomic_load_n(&th->trace, __ATOMIC_RELAXED))
+        return task_submit(th, c, func, arg);
+
+    // Join the entry at the tail if this thread queued it and it is not
+    // full; the thread that takes it is woken already.
+    pthread_mutex_lock(&ex->qmut);
+    struct task_t *tail = ex->qtail;
+    if (!th->stop && ex->slen == 0 && tail != NULL &&
+            tail->func == batch_run) {
+        struct batch_t *b = tail->arg;
+        if (b->len < b->cap && pthread_equal(b->owner, pthread_self())) {
+            b->tasks[b->len].func = func;
+            b->tasks[b->len].arg = arg;
+            b->len++;
+            pthread_mutex_unlock(&ex->qmut);
+            return true;
+        }
+    }
+    pthread_mutex_unlock(&ex->qmut);
+
+    size_t size = sizeof(struct batch_t) + cmax * sizeof(struct batch_item_t);
+    struct task_t *t = malloc(sizeof *t + size);
+    if (t == NULL)
+        return false;
+    struct batch_t *b = (struct batch_t *)(t + 1);
+    b->owner = pthread_self();
+    b->len = 1;
+    b->cap = cmax;
+    b->tasks[0].func = func;
+    b->tasks[0].arg = arg;
+    t->func = batch_run;
+    t->arg = b;
+    t->size = size;
+    t->tid = 0;
+    t->tag = 0;
+    return task_push(th, c, t);
 }
 
-// Signals the conditional variable in the given thread pool.
+// Queues a task for the threads of an executor class in a started pool,
+// giving the task its own copy of the data. The function receives a
+// pointer to the copy, which is freed once the function returns. Only
+// tasks with a copy are written out in full when the queue spills to
+// disk; other tasks keep pointing at memory owned by the caller.
 //
 // PARAMS:
-// th - the thread pool to signal
-// i  - the conditional variable index to signal
+// th   - the thread pool to run the task
+// c    - the executor class index
+// func - function to run
+// data - data to copy for the function
+// size - size of the data
 //
 // RETURN:
 // 1 (true) on success, 0 (false) on error.
-_Bool prethd_signal(prethd_t *th, size_t i) {
-    return (th == NULL || i >= th->clen) ? false :
-        pthread_cond_signal(th->conds + i) == 0;
+_Bool prethd_submit_copy(prethd_t *th, size_t c, void *(*func)(void *),
+        const void *data, size_t size) {
+    if (th == NULL || c >= th->elen || func == NULL ||
+            (data == NULL && size > 0))
+        return false;
+
+    struct task_t *t = malloc(sizeof *t + size);
+    if (t == NULL)
+        return false;
+    t->func = func;
+    t->arg = t + 1;
+    t->size = size;
+    t->tid = 0;
+    t->tag = 0;
+    memcpy(t + 1, data, size);
+    return task_push(th, c, t);
 }
 
-// Broadcasts the conditional variable in the given thread pool, waking up
-// all.
+// Queues a task for the threads of an executor class in a started pool,
+// tagged for CPU time accounting, see prethd_account(). Tasks queued
+// without a tag have tag 0.
 //
 // PARAMS:
-// th - the thread pool to broadcast
-// i  - the conditional variable index to broadcast
+// th   - the thread pool to run the task
+// c    - the executor class index
+// tag  - the tag to account the task's time to
+// func - function to run
+// arg  - argument for the function
 //
 // RETURN:
 // 1 (true) on success, 0 (false) on error.
-_Bool prethd_broad(prethd_t *th, size_t i) {
-    return (th == NULL || i >= th->clen) ? false :
-        pthread_cond_broadcast(th->conds + i) == 0;
+_Bool prethd_submit_tagged(prethd_t *th, size_t c, uint64_t tag,
+        void *(*func)(void *), void *arg) {
+    if (th == NULL || c >= th->elen || func == NULL)
+        return false;
+
+    struct task_t *t = malloc(sizeof *t);
+    if (t == NULL)
+        return false;
+    t->func = func;
+    t->arg = arg;
+    t->size = 0;
+    t->tid = 0;
+    t->tag = tag;
+    return task_push(th, c, t);
 }
 
-// Frees the specified thread pool.
+// Adds a disk overflow tier to the queue of an executor class. Once the
+// queue holds hiwat tasks, further tasks are appended to a memory mapped
+// file instead of being kept in memory, and the threads read them back as
+// the queue falls to half of hiwat. The file is used as a ring, so the
+// space of tasks read back is reused. Tasks are held in memory when the
+// file is full, so no task is ever rejected; they stay behind the spilled
+// tasks, which keeps the queue in submission order. The file is created
+// at path, which must not exist yet, and unlinked as soon as it is
+// mapped, so it never outlives the pool. Its disk space is given back
+// whenever it empties. A child of fork() inherits neither the file nor
+// the tasks in it, which stay with the parent.
 //
 // PARAMS:
-// th - the thread pool to free
-void prethd_free(prethd_t *th) {
-    if (th != NULL) {
-        des_muts(th->muts, th->mlen);
-        des_conds(th->conds, th->clen);
-        free(th->threads);
-        free(th);
+// th    - the thread pool to add the tier to
+// c     - the executor class index
+// path  - path of the spill file to create, not followed if a symlink
+// hiwat - queue length from which tasks spill
+// cap   - size of the spill file in bytes
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_spill(prethd_t *th, size_t c, const char *path, size_t hiwat,
+        size_t cap) {
+    if (th == NULL || c >= th->elen || path == NULL || hiwat == 0 ||
+            cap < sizeof(struct spill_rec_t))
+        return false;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+        0600);
+    if (fd < 0)
+        return false;
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)cap) == 0)
+        map = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    unlink(path);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
     }
+
+    struct exec_t *ex = th->execs + c;
+    pthread_mutex_lock(&ex->qmut);
+    if (ex->smap != NULL) {
+        pthread_mutex_unlock(&ex->qmut);
+        munmap(map, cap);
+        close(fd);
+        return false;
+    }
+    ex->smap = map;
+    ex->sfd = fd;
+    ex->scap = cap;
+    ex->shead = 0;
+    ex->stail = 0;
+    ex->swrap = 0;
+    ex->slen = 0;
+    ex->hiwat = hiwat;
+    pthread_mutex_unlock(&ex->qmut);
+    return true;
 }
 
-// Frees the specified thread pool. Waits for all threads to join before
-// freeing.
+// Returns the number of tasks of an executor class waiting in its spill
+// file.
 //
 // PARAMS:
-// th - the thread pool to free
-void prethd_join_free(prethd_t *th) {
-    if (prethd_join(th)) {
-        des_muts(th->muts, th->mlen);
-        des_conds(th->conds, th->clen);
-        free(th->threads);
-        free(th);
-    }
+// th - the thread pool to retrieve the count
+// c  - the executor class index
+//
+// RETURN:
+// The number of spilled tasks, or 0 on error.
+size_t prethd_spilled(prethd_t *th, size_t c) {
+    if (th == NULL || c >= th->elen)
+        return 0;
+
+    struct exec_t *ex = th->execs + c;
+    pthread_mutex_lock(&ex->qmut);
+    size_t ret = ex->slen;
+    pthread_mutex_unlock(&ex->qmut);
+    return ret;
 }
 
-// Returns an array of mutexes.
+// Turns coalescing of small tasks on or off for an executor class. While
+// on, a task queued with prethd_submit() or prethd_submit_to() while the
+// last task the same thread queued in the class is still waiting at the
+// tail of the queue joins that entry instead of taking its own, up to max
+// tasks per entry. One thread then runs them back to back, saving the
+// queueing and wake-up of all but the first. Nothing is held back, so
+// tasks never wait for a batch to fill. Traced tasks are not coalesced,
+// nor are the pool's own, e.g. those of prethd_async() or the parallel
+// algorithms.
 //
 // PARAMS:
-// n - the number of mutexes to create
+// th  - the thread pool to set
+// c   - the executor class index
+// max - most tasks per queue entry, 1 or 0 to turn coalescing off
 //
 // RETURN:
-// The array of mutexes, or NULL on error.
-static pthread_mutex_t *init_muts(size_t n) {
-    if (n == 0)
-        return NULL;
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_coalesce(prethd_t *th, size_t c, size_t max) {
+    if (th == NULL || c >= th->elen)
+        return false;
 
-    pthread_mutex_t *mut = malloc(n * (sizeof *mut));
-    if (mut != NULL)
-        for (size_t i = 0; i < n; i++)
-            pthread_mutex_init(mut + i, NULL);
-    return mut;
+    struct exec_t *ex = th->execs + c;
+    pthread_mutex_lock(&ex->qmut);
+    ex->cmax = (max > 1) ? max : 0;
+    pthread_mutex_unlock(&ex->qmut);
+    return true;
 }
 
-// Destroyes the array of mutexes.
+// Lets the given thread pool share its threads with the other pools that
+// do. Once a sharing pool has a task queued and none of its own threads
+// is free to take it, an idle thread of another sharing pool takes it, so
+// spare cores follow the load without more threads than cores. A lent
+// task runs as if on a thread outside its pool: prethd_spawn() runs
+// subtasks at once and prethd_resource() returns NULL, while
+// prethd_cancelled() and prethd_usage() count it with its pool. Shutting
+// the pool down waits for its lent tasks too. Must be called before
+// prethd_start().
 //
 // PARAMS:
-// muts - the array of mutexes to destroy
-// n    - the count of mutexes
-static void des_muts(pthread_mutex_t *muts, size_t n) {
-    if (muts != NULL && n > 0) {
-        for (size_t i = 0; i < n; i++)
-            pthread_mutex_destroy(muts + i);
-        free(muts);
-    }
+// th - the thread pool to set
+// on - 1 (true) to share, 0 (false) to stop
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_share(prethd_t *th, _Bool on) {
+    if (th == NULL || th->run > 0)
+        return false;
+
+    pthread_mutex_lock(&reg_mut);
+    __atomic_store_n(&th->share, on, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&reg_mut);
+    return true;
 }
 
-// Returns an array of conditional variables.
+// Turns tracing of the task graph on or off. While on, every task queued
+// with prethd_submit() and its variants, prethd_spawn() or
+// prethd_submit_from_signal() is given a trace id and its timings are
+// recorded. A task queued from inside a traced task depends on
+// the part of it that ran before; further dependencies are added with
+// prethd_trace_edge(). Turning tracing on discards the previous trace.
 //
 // PARAMS:
-// n - the number of conditional variables to create
+// th - the thread pool to trace
+// on - 1 (true) to trace, 0 (false) to stop
 //
 // RETURN:
-// The array of conditional variables, or NULL on error.
-static pthread_cond_t *init_conds(size_t n) {
-    if (n == 0)
-        return NULL;
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_trace(prethd_t *th, _Bool on) {
+    if (th == NULL)
+        return false;
 
-    pthread_cond_t *cond = malloc(n * (sizeof *cond));
-    if (cond != NULL)
-        for (size_t i = 0; i < n; i++)
-            pthread_cond_init(cond + i, NULL);
-    return cond;
+    pthread_mutex_lock(&th->tmut);
+    if (on && !th->trace) {
+        th->tlen = 0;
+        th->telen = 0;
+    }
+    __atomic_store_n(&th->trace, on, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&th->tmut);
+    return true;
 }
 
-// Destroyes the array of conditional variables.
+// Returns the trace id of the task running on the calling thread.
 //
 // PARAMS:
-// conds - the conditional variables to destroy
-// n     - the count of conditional variables
-static void des_conds(pthread_cond_t *conds, size_t n) {
-    if (conds != NULL && n > 0) {
-        for (size_t i = 0; i < n; i++)
-            pthread_cond_destroy(conds + i);
-        free(conds);
+// th - the thread pool running the task
+//
+// RETURN:
+// The trace id, or 0 if the calling thread is not running a traced task
+// of the pool.
+size_t prethd_trace_id(prethd_t *th) {
+    struct worker_t *w = self_get(th);
+    return (w == NULL) ? 0 : w->tid;
+}
+
+// Records that a traced task cannot start before another has returned.
+// Dependencies must point forward, to a task traced later.
+//
+// PARAMS:
+// th   - the thread pool running the tasks
+// from - trace id of the task depended on
+// to   - trace id of the dependent task
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_trace_edge(prethd_t *th, size_t from, size_t to) {
+    if (th == NULL || from == 0 || from >= to)
+        return false;
+
+    _Bool ret = false;
+    pthread_mutex_lock(&th->tmut);
+    if (to <= th->tlen) {
+        if (th->telen == th->tecap) {
+            size_t cap = (th->tecap == 0) ? 64 : th->tecap * 2;
+            void *mem = realloc(th->tedges, cap * (sizeof *th->tedges));
+            if (mem != NULL) {
+                th->tedges = mem;
+                th->tecap = cap;
+            }
+        }
+        if (th->telen < th->tecap) {
+            th->tedges[th->telen].from = from;
+            th->tedges[th->telen].to = to;
+            th->telen++;
+            ret = true;
+        }
+    }
+    pthread_mutex_unlock(&th->tmut);
+    return ret;
+}
+
+// Computes the critical path of the traced task graph: the chain of
+// dependent tasks with the longest total running time. Tasks off the
+// critical path have slack, the time they could be delayed without making
+// the graph take longer. Comparing the parallelism achieved with the
+// ideal one, work over span, tells whether more threads can help: once
+// they are close, the graph is bound by its span. The work of a task
+// leaves out the time it spent running nested tasks or in prethd_sync(),
+// so that nested work is counted once. Should be called once the traced
+// tasks have returned.
+//
+// PARAMS:
+// th - the thread pool traced
+// cp - receives the critical path, freed with prethd_cpath_free()
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error or if nothing was traced.
+_Bool prethd_critical_path(prethd_t *th, prethd_cpath_t *cp) {
+    if (th == NULL || cp == NULL)
+        return false;
+
+    cp->path = NULL;    // safe for prethd_cpath_free() on every error
+    cp->slack = NULL;
+    cp->plen = 0;
+    pthread_mutex_lock(&th->tmut);
+    size_t n = th->tlen;
+    struct trace_node_t *node = th->tnodes;
+    struct trace_edge_t *edge = th->tedges;
+    size_t ne = th->telen;
+    double *es = (n == 0) ? NULL : malloc(n * (sizeof *es));
+    double *ls = (n == 0) ? NULL : malloc(n * (sizeof *ls));
+    size_t *via = (n == 0) ? NULL : malloc(n * (sizeof *via));
+    if (es == NULL || ls == NULL || via == NULL) {
+        pthread_mutex_unlock(&th->tmut);
+        free(es);
+        free(ls);
+        free(via);
+        return false;
+    }
+    if (ne > 0)
+        qsort(edge, ne, sizeof *edge, trace_cmp);
+
+    // earliest start of each task, given only its dependencies
+    cp->work = 0;
+    cp->span = 0;
+    double first = node[0].start, last = node[0].end;
+    size_t tail = 0;
+    for (size_t v = 0, e = 0; v < n; v++) {
+        double dur = node[v].end - node[v].start;
+        es[v] = 0;
+        via[v] = 0;
+        if (node[v].parent > 0) {
+            struct trace_node_t *p = node + node[v].parent - 1;
+            double off = node[v].spawn - p->start;
+            off = (off < 0) ? 0 : (off > p->end - p->start) ?
+                p->end - p->start : off;
+            es[v] = es[node[v].parent - 1] + off;
+            via[v] = node[v].parent;
+        }
+        for (; e < ne && edge[e].to == v + 1; e++) {
+            size_t u = edge[e].from - 1;
+            double at = es[u] + node[u].end - node[u].start;
+            if (at > es[v]) {
+                es[v] = at;
+                via[v] = u + 1;
+            }
+        }
+        cp->work += dur - node[v].nest;     // nested work is counted once
+        if (es[v] + dur > cp->span) {
+            cp->span = es[v] + dur;
+            tail = v;
+        }
+        first = (node[v].start < first) ? node[v].start : first;
+        last = (node[v].end > last) ? node[v].end : last;
+    }
+
+    // latest start of each task that still finishes within the span
+    for (size_t v = 0; v < n; v++)
+        ls[v] = cp->span - (node[v].end - node[v].start);
+    for (size_t v = n, e = ne; v > 0; v--) {
+        struct trace_node_t *t = node + v - 1;
+        if (t->parent > 0) {
+            struct trace_node_t *p = node + t->parent - 1;
+            double off = t->spawn - p->start;
+            off = (off < 0) ? 0 : (off > p->end - p->start) ?
+                p->end - p->start : off;
+            if (ls[v - 1] - off < ls[t->parent - 1])
+                ls[t->parent - 1] = ls[v - 1] - off;
+        }
+        for (; e > 0 && edge[e - 1].to == v; e--) {
+            size_t u = edge[e - 1].from - 1;
+            double at = ls[v - 1] - (node[u].end - node[u].start);
+            if (at < ls[u])
+                ls[u] = at;
+        }
+    }
+    pthread_mutex_unlock(&th->tmut);
+
+    cp->tasks = n;
+    cp->wall = last - first;
+    cp->parallelism = (cp->wall > 0) ? cp->work / cp->wall : 0;
+    cp->ideal = (cp->span > 0) ? cp->work / cp->span : 0;
+    cp->slack = ls;
+    for (size_t v = 0; v < n; v++)
+        ls[v] -= es[v];
+    cp->plen = 0;
+    for (size_t v = tail + 1; v > 0; v = via[v - 1])
+        cp->plen++;
+    cp->path = malloc(cp->plen * (sizeof *cp->path));
+    if (cp->path == NULL) {
+        free(es);
+        free(ls);
+        free(via);
+        cp->slack = NULL;
+        cp->plen = 0;
+        return false;
+    }
+    size_t i = cp->plen;
+    for (size_t v = tail + 1; v > 0; v = via[v - 1])
+        cp->path[--i] = v;
+    free(es);
+    free(via);
+    return true;
+}
+
+// Frees the arrays of a critical path computed by prethd_critical_path().
+//
+// PARAMS:
+// cp - the critical path to free
+void prethd_cpath_free(prethd_cpath_t *cp) {
+    if (cp != NULL) {
+        free(cp->path);
+        free(cp->slack);
+        cp->path = NULL;
+        cp->slack = NULL;
+    }
+}
+
+// Turns CPU time accounting on or off. While on, the thread CPU time and
+// the wall time of every task taken off a queue are added up by the tag
+// the task was queued with, see prethd_submit_tagged(), in tables kept by
+// each thread and read with prethd_usage(). Subtasks of prethd_spawn()
+// are counted under the tag of the task that spawned them, and tasks of
+// prethd_submit_from_signal() under tag 0. The time of tasks run inside
+// another task while it waits is counted for them only.
+//
+// PARAMS:
+// th - the thread pool to account
+// on - 1 (true) to account, 0 (false) to stop
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_account(prethd_t *th, _Bool on) {
+    if (th == NULL)
+        return false;
+
+    __atomic_store_n(&th->acct, on, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Returns the time used by the tasks of each tag so far, added up over the
+// threads of the pool while they keep running. A tag whose wall time is
+// well above its CPU time spends its tasks blocked.
+//
+// PARAMS:
+// th  - the thread pool to read
+// out - receives the totals sorted by tag, freed with free()
+//
+// RETURN:
+// The number of tags, or 0 on error or if no task was accounted.
+size_t prethd_usage(prethd_t *th, prethd_usage_t **out) {
+    if (out != NULL)
+        *out = NULL;
+    if (th == NULL || out == NULL)
+        return 0;
+
+    size_t len = 0;
+    prethd_usage_t *all = NULL;
+    for (size_t i = 0; i <= th->len; i++) {     // the lent tasks last
+        struct usage_tab_t *tab = (i < th->len) ? &th->workers[i].atab :
+            &th->ltab;
+        pthread_mutex_t *mut = (i < th->len) ? &th->workers[i].amut :
+            &th->lmut;
+        pthread_mutex_lock(mut);
+        void *mem = (tab->len == 0) ? all :
+            realloc(all, (len + tab->len) * (sizeof *all));
+        if (mem == NULL) {
+            pthread_mutex_unlock(mut);
+            free(all);
+            return 0;
+        }
+        all = mem;
+        for (size_t j = 0; j < tab->cap; j++)
+            if (tab->used[j])
+                all[len++] = tab->slots[j];
+        pthread_mutex_unlock(mut);
+    }
+    if (len == 0)
+        return 0;
+
+    qsort(all, len, sizeof *all, usage_cmp);
+    size_t ret = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (ret > 0 && all[ret - 1].tag == all[i].tag) {
+            all[ret - 1].tasks += all[i].tasks;
+            all[ret - 1].cpu += all[i].cpu;
+            all[ret - 1].wall += all[i].wall;
+        } else {
+            all[ret++] = all[i];
+        }
+    }
+    *out = all;
+    return ret;
+}
+
+// Sets the seed of the per-thread random streams of the thread pool. The
+// stream of each thread is derived from the seed and the thread index, so
+// the same seed always gives the same streams. Applies from the next
+// prethd_start().
+//
+// PARAMS:
+// th   - the thread pool to seed
+// seed - the seed
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_seed(prethd_t *th, uint64_t seed) {
+    if (th == NULL)
+        return false;
+
+    th->seed = seed;
+    return true;
+}
+
+// Returns the random stream of the calling thread. Only the calling
+// thread may use it, so no locking is needed.
+//
+// PARAMS:
+// th - the thread pool the thread belongs to
+//
+// RETURN:
+// The random stream, or NULL if the calling thread is not running the
+// task loop of the pool.
+prethd_rng_t *prethd_rng(prethd_t *th) {
+    struct worker_t *w = self_get(th);
+    return (w == NULL) ? NULL : &w->rng;
+}
+
+// Initialises a counter-based (Philox4x32-10) random stream. Streams with
+// the same seed but different stream numbers are independent; seeding a
+// stream by task rather than by thread makes the numbers a task gets
+// independent of the schedule.
+//
+// PARAMS:
+// r      - the random stream to initialise
+// seed   - the seed
+// stream - the stream number
+void prethd_rng_init(prethd_rng_t *r, uint64_t seed, uint64_t stream) {
+    if (r != NULL) {
+        r->key[0] = (uint32_t)seed;
+        r->key[1] = (uint32_t)(seed >> 32);
+        r->stream[0] = (uint32_t)stream;
+        r->stream[1] = (uint32_t)(stream >> 32);
+        r->ctr = 0;
+        r->pos = 4;
+    }
+}
+
+// Returns the next 32 random bits of a random stream.
+//
+// PARAMS:
+// r - the random stream
+//
+// RETURN:
+// The random bits.
+uint32_t prethd_rng_u32(prethd_rng_t *r) {
+    if (r->pos == 4) {
+        rng_block(r, r->ctr++, r->buf);
+        r->pos = 0;
+    }
+    return r->buf[r->pos++];
+}
+
+// Returns the next 64 random bits of a random stream.
+//
+// PARAMS:
+// r - the random stream
+//
+// RETURN:
+// The random bits.
+uint64_t prethd_rng_u64(prethd_rng_t *r) {
+    uint64_t hi = prethd_rng_u32(r);
+    return (hi << 32) | prethd_rng_u32(r);
+}
+
+// Returns the next random number of a random stream, uniform in [0, 1).
+//
+// PARAMS:
+// r - the random stream
+//
+// RETURN:
+// The random number.
+double prethd_rng_double(prethd_rng_t *r) {
+    return (double)(prethd_rng_u64(r) >> 11) * 0x1.0p-53;
+}
+
+// Fills an array with random bits from a random stream. Whole blocks are
+// generated straight into the array from independent counters, which
+// compilers can vectorise.
+//
+// PARAMS:
+// r   - the random stream
+// out - the array to fill
+// n   - number of elements
+void prethd_rng_fill_u32(prethd_rng_t *r, uint32_t *out, size_t n) {
+    while (n > 0 && r->pos < 4) {
+        *out++ = r->buf[r->pos++];
+        n--;
+    }
+    size_t blocks = n / 4;
+    for (size_t b = 0; b < blocks; b++)
+        rng_block(r, r->ctr + b, out + 4 * b);
+    r->ctr += blocks;
+    for (size_t i = blocks * 4; i < n; i++)
+        out[i] = prethd_rng_u32(r);
+}
+
+// Fills an array with random numbers from a random stream, uniform in
+// [0, 1).
+//
+// PARAMS:
+// r   - the random stream
+// out - the array to fill
+// n   - number of elements
+void prethd_rng_fill_double(prethd_rng_t *r, double *out, size_t n) {
+    uint32_t blk[4];
+    while (n > 0 && r->pos < 4) {
+        *out++ = prethd_rng_double(r);
+        n--;
+    }
+    size_t blocks = n / 2;
+    for (size_t b = 0; b < blocks; b++) {
+        rng_block(r, r->ctr + b, blk);
+        out[2 * b] = (double)((((uint64_t)blk[0] << 32) | blk[1]) >> 11) *
+            0x1.0p-53;
+        out[2 * b + 1] = (double)((((uint64_t)blk[2] << 32) | blk[3]) >> 11) *
+            0x1.0p-53;
+    }
+    r->ctr += blocks;
+    if (n % 2 == 1)
+        out[n - 1] = prethd_rng_double(r);
+}
+
+// Allocates the ring used by prethd_submit_from_signal(). Must be called
+// before any task is submitted from a signal handler.
+//
+// PARAMS:
+// th - the thread pool to allocate the ring for
+// n  - number of slots, rounded up to a power of two
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sigring(prethd_t *th, size_t n) {
+    if (th == NULL || n == 0 || th->ring != NULL)
+        return false;
+
+    size_t cap = 1;
+    while (cap < n)
+        cap <<= 1;
+    struct sig_slot_t *ring = malloc(cap * (sizeof *ring));
+    if (ring == NULL)
+        return false;
+    for (size_t i = 0; i < cap; i++)
+        ring[i].seq = i;
+    th->rmask = cap - 1;
+    th->rhead = 0;
+    th->rtail = 0;
+    __atomic_store_n(&th->ring, ring, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Queues a task from a signal handler. Async-signal-safe: the task goes
+// into the ring allocated by prethd_sigring() without locking or
+// allocating, and a thread of the first executor class is woken with
+// sem_post().
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error or if the ring is full.
+_Bool prethd_submit_from_signal(prethd_t *th, void *(*func)(void *),
+        void *arg) {
+    if (th == NULL || func == NULL || __atomic_load_n(&th->stop,
+            __ATOMIC_ACQUIRE))
+        return false;
+    if (!ring_push(th, func, arg))
+        return false;
+    return sem_post(&th->execs->qsem) == 0;
+}
+
+// Restarts the threads of a pool inherited across fork(). The child gets
+// the pool with its mutexes and conditional variables reinitialised but
+// without any threads; this starts them again with the task loop, or with
+// the function and argument given to the last prethd_all().
+//
+// PARAMS:
+// th - the inherited thread pool to restart
+//
+// RETURN:
+// The number of threads started, 0 on error.
+size_t prethd_respawn(prethd_t *th) {
+    if (th == NULL || !th->forked)
+        return 0;
+
+    // prethd_start() clears func, so a pool with one ran prethd_all().
+    size_t ret = (th->func != NULL) ? prethd_all(th, th->func, th->arg) :
+        prethd_start(th);
+    if (ret > 0)
+        __atomic_store_n(&th->forked, false, __ATOMIC_RELEASE);
+    return ret;
+}
+
+// Returns the number of threads in the thread pool.
+//
+// PARAMS:
+// th - the thread pool to retrieve the size
+//
+// RETURN:
+// The thread pool size, or 0 on error.
+size_t prethd_size(prethd_t *th) {
+    return (th == NULL) ? 0 : th->len;
+}
+
+// Returns the number of mutexes in the thread pool.
+//
+// PARAMS:
+// th - the thread pool to retrieve the size
+//
+// RETURN:
+// The thread pool mutex size, or 0 on error.
+size_t prethd_mutex_size(prethd_t *th) {
+    return (th == NULL) ? 0 : th->mlen;
+}
+
+// Returns the number of conditional variables in the thread pool.
+//
+// PARAMS:
+// th - the thread pool to retrieve the size
+//
+// RETURN:
+// The thread pool conditional variable size, or 0 on error.
+size_t prethd_cond_size(prethd_t *th) {
+    return (th == NULL) ? 0 : th->clen;
+}
+
+// Joins all threads in the thread pool. Threads running the task loop
+// first finish every queued task.
+//
+// PARAMS:
+// th - the thread pool to join
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_join(prethd_t *th) {
+    return prethd_shutdown(th, PRETHD_DRAIN, NULL);
+}
+
+// Shuts down the threads of the given thread pool. Threads running the
+// task loop finish their current task and exit; depending on the mode,
+// queued tasks are run first or dropped. The call waits for the threads
+// no later than the deadline, then joins them. On timeout the threads
+// are left to finish, and the call can be repeated to wait for them
+// again. The pool can be started again once shut down.
+//
+// PARAMS:
+// th       - the thread pool to shut down
+// mode     - what happens to queued and running tasks
+// deadline - absolute CLOCK_REALTIME time to give up at, or NULL to wait
+//            as long as needed; only bounds threads running the task loop
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error or timeout.
+_Bool prethd_shutdown(prethd_t *th, prethd_mode_t mode,
+        const struct timespec *deadline) {
+    if (th == NULL)
+        return false;
+
+    if (th->tasks) {
+        _Bool first = !th->stop;
+        for (size_t i = 0; i < th->elen; i++) {
+            pthread_mutex_lock(&th->execs[i].qmut);
+            __atomic_store_n(&th->stop, true, __ATOMIC_RELEASE);
+            if (mode != PRETHD_DRAIN)
+                __atomic_store_n(&th->cancel, true, __ATOMIC_RELEASE);
+            if (mode == PRETHD_ABORT)
+                __atomic_store_n(&th->abort, true, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&th->execs[i].qmut);
+        }
+        if (mode != PRETHD_DRAIN)
+            drop_tasks(th);
+        if (first)
+            for (size_t i = 0; i < th->run; i++)
+                sem_post(&th->workers[i].exec->qsem);
+
+        int chk = 0;
+        pthread_mutex_lock(&th->xmut);
+        while ((th->live > 0 || __atomic_load_n(&th->lent,
+                __ATOMIC_SEQ_CST) > 0) && chk == 0)
+            chk = (deadline == NULL) ?
+                pthread_cond_wait(&th->xcond, &th->xmut) :
+                pthread_cond_timedwait(&th->xcond, &th->xmut, deadline);
+        size_t live = th->live + __atomic_load_n(&th->lent,
+            __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&th->xmut);
+        if (live > 0)
+            return false;
+    }
+
+    int chk = 0;
+    for (size_t i = 0; i < th->run; i++)
+        chk += pthread_join(th->threads[i], NULL);
+    th->run = 0;
+    __atomic_store_n(&th->tasks, false, __ATOMIC_RELEASE);
+    th->stop = false;
+    th->cancel = false;
+    th->abort = false;
+    return chk == 0;
+}
+
+// Tells a running task whether the pool is being shut down with
+// PRETHD_ABORT, so that long tasks can return early.
+//
+// PARAMS:
+// th - the thread pool running the task
+//
+// RETURN:
+// 1 (true) if the task should return early, 0 (false) otherwise.
+_Bool prethd_aborted(prethd_t *th) {
+    return th != NULL && __atomic_load_n(&th->abort, __ATOMIC_ACQUIRE);
+}
+
+// Locks the given thread pool.
+//
+// PARAMS:
+// th - the thread pool to lock
+// i  - the index of mutex to lock
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_lock(prethd_t *th, size_t i) {
+    return (th == NULL || i >= th->mlen) ? false :
+        pthread_mutex_lock(th->muts + i) == 0;
+}
+
+// Unocks the given thread pool.
+//
+// PARAMS:
+// th - the thread pool to unlock
+// i  - the index of mutex to unlock
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_unlock(prethd_t *th, size_t i) {
+    return (th == NULL || i >= th->mlen) ? false :
+        pthread_mutex_unlock(th->muts + i) == 0;
+}
+
+// Make the given thread pool wait on the conditional variable.
+//
+// PARAMS:
+// th - the thread pool to wait
+// c  - the conditional variable index to wait
+// m  - the mutex index to use
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_wait(prethd_t *th, size_t c, size_t m) {
+    return (th == NULL || c >= th->clen || m >= th->mlen) ? false :
+        pthread_cond_wait(th->conds + c, th->muts + m) == 0;
+}
+
+// Signals the conditional variable in the given thread pool.
+//
+// PARAMS:
+// th - the thread pool to signal
+// i  - the conditional variable index to signal
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_signal(prethd_t *th, size_t i) {
+    return (th == NULL || i >= th->clen) ? false :
+        pthread_cond_signal(th->conds + i) == 0;
+}
+
+// Broadcasts the conditional variable in the given thread pool, waking up
+// all.
+//
+// PARAMS:
+// th - the thread pool to broadcast
+// i  - the conditional variable index to broadcast
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_broad(prethd_t *th, size_t i) {
+    return (th == NULL || i >= th->clen) ? false :
+        pthread_cond_broadcast(th->conds + i) == 0;
+}
+
+// Allocates a bounded queue of pointers for producer and consumer threads,
+// guarded by a mutex of the given thread pool. Consumers wait on one
+// conditional variable and producers on another, and each is only
+// signalled when a thread waits on it. Being the pool's own, the sync
+// objects are reset across fork() with the rest. The conditional variables
+// must not be used for anything else.
+//
+// PARAMS:
+// th  - the thread pool owning the sync objects
+// cap - maximum number of items in the queue
+// m   - the mutex index to guard the queue with
+// ne  - the conditional variable index consumers wait on
+// nf  - the conditional variable index producers wait on
+//
+// RETURN:
+// The queue, or NULL on error.
+prethd_bqueue_t *prethd_bqueue_new(prethd_t *th, size_t cap, size_t m,
+        size_t ne, size_t nf) {
+    if (th == NULL || cap == 0 || m >= th->mlen || ne >= th->clen ||
+            nf >= th->clen || ne == nf)
+        return NULL;
+
+    prethd_bqueue_t *q = malloc(sizeof *q);
+    if (q == NULL)
+        return NULL;
+    q->items = malloc(cap * (sizeof *q->items));
+    if (q->items == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->pool = th;
+    q->cap = cap;
+    q->head = 0;
+    q->len = 0;
+    q->m = m;
+    q->ne = ne;
+    q->nf = nf;
+    q->cwait = 0;
+    q->pwait = 0;
+    q->closed = false;
+    return q;
+}
+
+// Adds items to a queue, in order, waiting for room whenever it is full.
+// Consumers are woken once per batch of items that fit rather than once
+// per item.
+//
+// PARAMS:
+// q     - the queue to add to
+// items - the items to add
+// n     - number of items
+//
+// RETURN:
+// The number of items added, less than n if the queue was closed
+// meanwhile.
+size_t prethd_bqueue_push(prethd_bqueue_t *q, void *const *items, size_t n) {
+    if (q == NULL || (items == NULL && n > 0))
+        return 0;
+
+    pthread_mutex_t *mut = q->pool->muts + q->m;
+    size_t ret = 0;
+    pthread_mutex_lock(mut);
+    while (ret < n && !q->closed) {
+        if (q->len == q->cap) {
+            q->pwait++;
+            pthread_cond_wait(q->pool->conds + q->nf, mut);
+            q->pwait--;
+            continue;
+        }
+        size_t k = 0;
+        for (; ret < n && q->len < q->cap; k++, ret++)
+            q->items[(q->head + q->len++) % q->cap] = items[ret];
+        bq_wake(q->pool->conds + q->ne, q->cwait, k);
+    }
+    pthread_mutex_unlock(mut);
+    return ret;
+}
+
+// Takes up to max items off a queue, in order, waiting until there is at
+// least one.
+//
+// PARAMS:
+// q     - the queue to take from
+// items - receives the items
+// max   - most items to take
+//
+// RETURN:
+// The number of items taken, 0 on error or if the queue is closed and
+// empty.
+size_t prethd_bqueue_pop(prethd_bqueue_t *q, void **items, size_t max) {
+    if (q == NULL || items == NULL || max == 0)
+        return 0;
+
+    pthread_mutex_t *mut = q->pool->muts + q->m;
+    pthread_mutex_lock(mut);
+    while (q->len == 0 && !q->closed) {
+        q->cwait++;
+        pthread_cond_wait(q->pool->conds + q->ne, mut);
+        q->cwait--;
+    }
+    size_t k = (q->len < max) ? q->len : max;
+    for (size_t i = 0; i < k; i++) {
+        items[i] = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+    }
+    q->len -= k;
+    bq_wake(q->pool->conds + q->nf, q->pwait, k);
+    pthread_mutex_unlock(mut);
+    return k;
+}
+
+// Closes a queue: further pushes fail, pops return the items left and
+// then 0, and every waiting thread is woken.
+//
+// PARAMS:
+// q - the queue to close
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_bqueue_close(prethd_bqueue_t *q) {
+    if (q == NULL)
+        return false;
+
+    pthread_mutex_lock(q->pool->muts + q->m);
+    q->closed = true;
+    pthread_cond_broadcast(q->pool->conds + q->ne);
+    pthread_cond_broadcast(q->pool->conds + q->nf);
+    pthread_mutex_unlock(q->pool->muts + q->m);
+    return true;
+}
+
+// Returns the number of items in a queue.
+//
+// PARAMS:
+// q - the queue
+//
+// RETURN:
+// The number of items, 0 on error.
+size_t prethd_bqueue_len(prethd_bqueue_t *q) {
+    if (q == NULL)
+        return 0;
+
+    pthread_mutex_lock(q->pool->muts + q->m);
+    size_t ret = q->len;
+    pthread_mutex_unlock(q->pool->muts + q->m);
+    return ret;
+}
+
+// Frees a queue. No thread may be waiting on it.
+//
+// PARAMS:
+// q - the queue to free
+void prethd_bqueue_free(prethd_bqueue_t *q) {
+    if (q != NULL) {
+        free(q->items);
+        free(q);
+    }
+}
+
+// Allocates the counting semaphores of the thread pool, next to its
+// mutexes and conditional variables. Acquiring a free permit and releasing
+// one without waiters stays in user space.
+//
+// PARAMS:
+// th     - the thread pool to allocate the semaphores for
+// values - initial permit count of each semaphore
+// n      - number of semaphores
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sems(prethd_t *th, const unsigned *values, size_t n) {
+    if (th == NULL || values == NULL || n == 0 || th->sems != NULL)
+        return false;
+
+    th->sems = init_sems(values, n);
+    if (th->sems == NULL)
+        return false;
+    th->slen = n;
+    return true;
+}
+
+// Returns the number of semaphores in the thread pool.
+//
+// PARAMS:
+// th - the thread pool to retrieve the size
+//
+// RETURN:
+// The thread pool semaphore size, or 0 on error.
+size_t prethd_sem_size(prethd_t *th) {
+    return (th == NULL) ? 0 : th->slen;
+}
+
+// Acquires a permit from a semaphore in the given thread pool, waiting
+// until one is available.
+//
+// PARAMS:
+// th - the thread pool to acquire from
+// i  - the index of semaphore to acquire
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sem_acquire(prethd_t *th, size_t i) {
+    if (th == NULL || i >= th->slen)
+        return false;
+
+    int chk;
+    while ((chk = sem_wait(&th->sems[i].sem)) != 0 && errno == EINTR)
+        ;
+    return chk == 0;
+}
+
+// Acquires a permit from a semaphore in the given thread pool, waiting no
+// later than the given time.
+//
+// PARAMS:
+// th      - the thread pool to acquire from
+// i       - the index of semaphore to acquire
+// abstime - absolute CLOCK_REALTIME time to give up at
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error or timeout.
+_Bool prethd_sem_timed(prethd_t *th, size_t i,
+        const struct timespec *abstime) {
+    if (th == NULL || i >= th->slen || abstime == NULL)
+        return false;
+
+    int chk;
+    while ((chk = sem_timedwait(&th->sems[i].sem, abstime)) != 0 &&
+            errno == EINTR)
+        ;
+    return chk == 0;
+}
+
+// Acquires a permit from a semaphore in the given thread pool without
+// waiting.
+//
+// PARAMS:
+// th - the thread pool to acquire from
+// i  - the index of semaphore to acquire
+//
+// RETURN:
+// 1 (true) if a permit was acquired, 0 (false) on error or if none is
+// available.
+_Bool prethd_sem_try(prethd_t *th, size_t i) {
+    return (th == NULL || i >= th->slen) ? false :
+        sem_trywait(&th->sems[i].sem) == 0;
+}
+
+// Releases a permit to a semaphore in the given thread pool. The permit
+// goes to a parked bulkhead task if there is one.
+//
+// PARAMS:
+// th - the thread pool to release to
+// i  - the index of semaphore to release
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sem_release(prethd_t *th, size_t i) {
+    if (th == NULL || i >= th->slen)
+        return false;
+
+    struct psem_t *ps = th->sems + i;
+    if (sem_post(&ps->sem) != 0)
+        return false;
+    if (__atomic_load_n(&ps->plen, __ATOMIC_SEQ_CST) > 0)
+        bulk_drain(th, ps);
+    return true;
+}
+
+// Queues a task behind a bulkhead: at most as many tasks as the semaphore
+// has permits run at once. A task finding no permit is parked without
+// holding up a thread, and is queued again once a permit is released.
+// The permit is released when the function returns.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// c    - the executor class index
+// s    - the index of semaphore limiting the task
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_submit_bulkhead(prethd_t *th, size_t c, size_t s,
+        void *(*func)(void *), void *arg) {
+    if (th == NULL || s >= th->slen || func == NULL)
+        return false;
+
+    struct bulk_t *b = malloc(sizeof *b);
+    if (b == NULL)
+        return false;
+    b->pool = th;
+    b->c = c;
+    b->s = s;
+    b->held = false;
+    b->func = func;
+    b->arg = arg;
+    b->next = NULL;
+    if (!task_submit(th, c, bulk_run, b)) {
+        free(b);
+        return false;
+    }
+    return true;
+}
+
+// Counts items into bins using the threads of the given thread pool. Each
+// thread counts a chunk of the items into its own table, small enough to
+// stay in its cache, and the tables are then added up pairwise in
+// parallel. Items binned past the last bin are skipped.
+//
+// PARAMS:
+// th     - the thread pool to count with
+// data   - the items to count
+// n      - number of items
+// size   - size of each item
+// bin    - returns the bin of an item
+// ctx    - argument for bin
+// counts - receives the count of each bin
+// nbins  - number of bins
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_parallel_histogram(prethd_t *th, const void *data, size_t n,
+        size_t size, size_t (*bin)(const void *item, void *ctx), void *ctx,
+        size_t *counts, size_t nbins) {
+    if (th == NULL || (data == NULL && n > 0) || size == 0 || bin == NULL ||
+            counts == NULL || nbins == 0)
+        return false;
+
+    struct agg_t agg;
+    agg.data = data;
+    agg.n = n;
+    agg.size = size;
+    agg.bin = bin;
+    agg.ctx = ctx;
+    agg.nbins = nbins;
+    agg.k = (n < th->len + 1) ? ((n == 0) ? 1 : n) : th->len + 1;
+    agg.counts = calloc(agg.k * nbins, sizeof *agg.counts);
+    if (agg.counts == NULL)
+        return false;
+
+    _Bool ret = par_run(th, agg.k, hist_chunk, &agg);
+    for (agg.stride = 1; ret && agg.stride < agg.k; agg.stride *= 2)
+        ret = par_run(th, (agg.k + 2 * agg.stride - 1) / (2 * agg.stride),
+            hist_merge, &agg);
+    if (ret)
+        memcpy(counts, agg.counts, nbins * (sizeof *counts));
+    free(agg.counts);
+    return ret;
+}
+
+// Copies the items matching a predicate, in their original order, using
+// the threads of the given thread pool. Each thread counts the matches in
+// a chunk of the items, the counts are summed into output offsets, and
+// each thread then copies its matches to its own offset, so no locking is
+// needed. The predicate is called twice for each item and must return the
+// same both times.
+//
+// PARAMS:
+// th   - the thread pool to filter with
+// data - the items to filter
+// n    - number of items
+// size - size of each item
+// pred - returns 1 (true) for the items to keep
+// ctx  - argument for pred
+// out  - receives the kept items, room for n items not overlapping data
+// len  - receives the number of kept items
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_parallel_filter(prethd_t *th, const void *data, size_t n,
+        size_t size, _Bool (*pred)(const void *item, void *ctx), void *ctx,
+        void *out, size_t *len) {
+    return part_run(th, data, n, size, pred, ctx, out, len, false);
+}
+
+// Partitions items by a predicate, keeping the original order within both
+// parts, using the threads of the given thread pool as in
+// prethd_parallel_filter(). The predicate is called twice for each item
+// and must return the same both times.
+//
+// PARAMS:
+// th   - the thread pool to partition with
+// data - the items to partition
+// n    - number of items
+// size - size of each item
+// pred - returns 1 (true) for the items of the first part
+// ctx  - argument for pred
+// out  - receives the first part then the second, room for n items not
+//        overlapping data
+// len  - receives the number of items in the first part
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_parallel_partition(prethd_t *th, const void *data, size_t n,
+        size_t size, _Bool (*pred)(const void *item, void *ctx), void *ctx,
+        void *out, size_t *len) {
+    return part_run(th, data, n, size, pred, ctx, out, len, true);
+}
+
+// Computes the distance in edges of every vertex from a source vertex with
+// a breadth-first search using the threads of the given thread pool. The
+// graph is in compressed sparse row form: the out-neighbours of vertex v
+// are adj[offs[v]] to adj[offs[v + 1] - 1]. Levels with a small frontier
+// are expanded top-down from a vertex list, each thread collecting the
+// vertices it finds in its own buffer. Levels with a large frontier are
+// expanded bottom-up, each thread checking its own range of unvisited
+// vertices for an in-neighbour in a bitmap of the frontier. Neither needs
+// a lock.
+//
+// PARAMS:
+// th    - the thread pool to search with
+// offs  - out-edge offsets of each vertex, nv + 1 of them
+// adj   - out-neighbours of all vertices
+// roffs - in-edge offsets of each vertex, NULL if the graph is undirected
+// radj  - in-neighbours of all vertices, NULL if the graph is undirected
+// nv    - number of vertices
+// src   - the source vertex
+// dist  - receives the distance of each vertex, SIZE_MAX if unreachable
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_parallel_bfs(prethd_t *th, const size_t *offs,
+        const size_t *adj, const size_t *roffs, const size_t *radj,
+        size_t nv, size_t src, size_t *dist) {
+    if (th == NULL || offs == NULL || adj == NULL || dist == NULL ||
+            src >= nv || (roffs == NULL) != (radj == NULL))
+        return false;
+
+    struct bfs_t bfs;
+    bfs.offs = offs;
+    bfs.adj = adj;
+    bfs.roffs = (roffs == NULL) ? offs : roffs;
+    bfs.radj = (radj == NULL) ? adj : radj;
+    bfs.nv = nv;
+    bfs.nw = (nv + 63) / 64;
+    bfs.dist = dist;
+    bfs.k = th->len + 1;
+    bfs.err = false;
+    bfs.front = malloc(nv * (sizeof *bfs.front));
+    bfs.nfront = malloc(nv * (sizeof *bfs.nfront));
+    bfs.bits = malloc(bfs.nw * (sizeof *bfs.bits));
+    bfs.nbits = malloc(bfs.nw * (sizeof *bfs.nbits));
+    bfs.bufs = calloc(bfs.k, sizeof *bfs.bufs);
+    _Bool ret = bfs.front != NULL && bfs.nfront != NULL && bfs.bits != NULL &&
+        bfs.nbits != NULL && bfs.bufs != NULL;
+
+    for (size_t v = 0; ret && v < nv; v++)
+        dist[v] = SIZE_MAX;
+    if (ret) {
+        dist[src] = 0;
+        bfs.front[0] = src;
+        bfs.flen = 1;
+        bfs.level = 0;
+    }
+
+    // Switch to bottom-up once the frontier's edges outweigh a 14th of
+    // the unvisited vertices' edges, and back once the frontier shrinks
+    // below a 24th of the vertices.
+    size_t mf = offs[src + 1] - offs[src], mu = offs[nv] - mf;
+    _Bool up = false;
+    while (ret && bfs.flen > 0) {
+        size_t prev = bfs.flen;
+        if (!up && mf > mu / 14) {
+            memset(bfs.bits, 0, bfs.nw * (sizeof *bfs.bits));
+            ret = par_run(th, bfs.k, bfs_pack, &bfs);
+            up = true;
+        }
+        if (ret)
+            ret = par_run(th, bfs.k, up ? bfs_up : bfs_down, &bfs) &&
+                !bfs.err;
+
+        mf = 0;
+        bfs.flen = 0;
+        for (size_t i = 0; ret && i < bfs.k; i++) {
+            size_t c = bfs.bufs[i].len;
+            bfs.bufs[i].len = bfs.flen;
+            bfs.flen += c;
+            mf += bfs.bufs[i].edges;
+        }
+        mu -= mf;
+        bfs.level++;
+        if (!ret || bfs.flen == 0)
+            break;
+
+        if (!up) {
+            ret = par_run(th, bfs.k, bfs_gather, &bfs);
+        } else if (bfs.flen < prev && bfs.flen < nv / 24) {
+            ret = par_run(th, bfs.k, bfs_unpack, &bfs);
+            up = false;
+        } else {
+            uint64_t *bits = bfs.bits;
+            bfs.bits = bfs.nbits;
+            bfs.nbits = bits;
+        }
+        if (!up) {
+            size_t *front = bfs.front;
+            bfs.front = bfs.nfront;
+            bfs.nfront = front;
+        }
+    }
+
+    for (size_t i = 0; bfs.bufs != NULL && i < bfs.k; i++)
+        free(bfs.bufs[i].v);
+    free(bfs.bufs);
+    free(bfs.front);
+    free(bfs.nfront);
+    free(bfs.bits);
+    free(bfs.nbits);
+    return ret;
+}
+
+// Groups values by key and adds them up using the threads of the given
+// thread pool. Each thread groups a chunk of the items into its own hash
+// table, and the tables are then merged pairwise in parallel. The groups
+// are returned sorted by key.
+//
+// PARAMS:
+// th   - the thread pool to group with
+// keys - the key of each item
+// vals - the value of each item
+// n    - number of items
+// out  - receives the groups, freed with free()
+//
+// RETURN:
+// The number of groups, or 0 on error.
+size_t prethd_parallel_groupby(prethd_t *th, const uint64_t *keys,
+        const double *vals, size_t n, prethd_group_t **out) {
+    if (out != NULL)
+        *out = NULL;
+    if (th == NULL || keys == NULL || vals == NULL || n == 0 || out == NULL)
+        return 0;
+
+    struct agg_t agg;
+    agg.data = (const unsigned char *)keys;
+    agg.vals = vals;
+    agg.n = n;
+    agg.err = false;
+    agg.k = (n < th->len + 1) ? n : th->len + 1;
+    agg.tabs = calloc(agg.k, sizeof *agg.tabs);
+    if (agg.tabs == NULL)
+        return 0;
+
+    _Bool ok = par_run(th, agg.k, group_chunk, &agg);
+    for (agg.stride = 1; ok && !agg.err && agg.stride < agg.k;
+            agg.stride *= 2)
+        ok = par_run(th, (agg.k + 2 * agg.stride - 1) / (2 * agg.stride),
+            group_merge, &agg);
+
+    size_t ret = 0;
+    struct group_tab_t *tab = agg.tabs;
+    if (ok && !agg.err && (*out = malloc(tab->len * (sizeof **out))) != NULL) {
+        for (size_t i = 0; i < tab->cap; i++)
+            if (tab->used[i])
+                (*out)[ret++] = tab->slots[i];
+        qsort(*out, ret, sizeof **out, group_cmp);
+    }
+    for (size_t i = 0; i < agg.k; i++)
+        group_free(agg.tabs + i);
+    free(agg.tabs);
+    return ret;
+}
+
+// Queues a task for the threads of an executor class in a started pool,
+// returning a future for its result.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// c    - the executor class index
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// The future of the task, freed with prethd_future_free(), or NULL on
+// error.
+prethd_future_t *prethd_async(prethd_t *th, size_t c,
+        void *(*func)(void *), void *arg) {
+    if (th == NULL || func == NULL)
+        return NULL;
+
+    prethd_future_t *f = malloc(sizeof *f);
+    if (f == NULL)
+        return NULL;
+    f->pool = th;
+    f->func = func;
+    f->arg = arg;
+    f->ret = NULL;
+    f->state = FUT_PENDING;
+    f->cancel = false;
+    f->refs = 2;
+    f->waiters = NULL;
+    pthread_mutex_init(&f->mut, NULL);
+    if (!task_submit(th, c, fut_run, f)) {
+        pthread_mutex_destroy(&f->mut);
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+// Waits for the task of a future to return. Called from a task of the
+// pool, the calling thread runs other queued tasks of its class while
+// waiting.
+//
+// PARAMS:
+// f   - the future to wait for
+// ret - receives the value returned by the task, can be NULL
+//
+// RETURN:
+// 1 (true) if the task returned, 0 (false) on error or if it was
+// cancelled before it started.
+_Bool prethd_future_get(prethd_future_t *f, void **ret) {
+    if (f == NULL || !fut_wait(&f, 1, false) ||
+            __atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != FUT_DONE)
+        return false;
+    if (ret != NULL)
+        *ret = f->ret;
+    return true;
+}
+
+// Cancels the task of a future. A task not started yet never runs; a
+// running task sees prethd_cancelled() return true and may return early.
+//
+// PARAMS:
+// f - the future to cancel
+//
+// RETURN:
+// 1 (true) if the task had not returned yet, 0 (false) otherwise.
+_Bool prethd_future_cancel(prethd_future_t *f) {
+    if (f == NULL)
+        return false;
+
+    int state = FUT_PENDING;
+    if (__atomic_compare_exchange_n(&f->state, &state, FUT_CANCELLED, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        fut_finish(f, FUT_CANCELLED);
+        return true;
+    }
+    __atomic_store_n(&f->cancel, true, __ATOMIC_RELEASE);
+    return state == FUT_RUNNING;
+}
+
+// Tells a running task whether its future was cancelled, or the pool is
+// being shut down with PRETHD_ABORT, so that it can return early.
+//
+// PARAMS:
+// th - the thread pool running the task
+//
+// RETURN:
+// 1 (true) if the task should return early, 0 (false) otherwise.
+_Bool prethd_cancelled(prethd_t *th) {
+    struct worker_t *w = (th == NULL) ? NULL : self_any();
+    return prethd_aborted(th) || (w != NULL && w->fut != NULL &&
+        w->fut->pool == th &&
+        __atomic_load_n(&w->fut->cancel, __ATOMIC_ACQUIRE));
+}
+
+// Frees a future. The task of the future is not cancelled and may still
+// run.
+//
+// PARAMS:
+// f - the future to free
+void prethd_future_free(prethd_future_t *f) {
+    if (f != NULL && __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&f->mut);
+        free(f);
+    }
+}
+
+// Waits for the tasks of all the futures to return or be cancelled.
+// Called from a task of the pool, the calling thread runs other queued
+// tasks of its class while waiting.
+//
+// PARAMS:
+// futs - the futures to wait for
+// n    - number of futures
+//
+// RETURN:
+// 1 (true) if every task returned, 0 (false) on error or if any was
+// cancelled before it started.
+_Bool prethd_when_all(prethd_future_t **futs, size_t n) {
+    if (futs == NULL || !fut_wait(futs, n, false))
+        return false;
+    for (size_t i = 0; i < n; i++)
+        if (__atomic_load_n(&futs[i]->state, __ATOMIC_ACQUIRE) != FUT_DONE)
+            return false;
+    return true;
+}
+
+// Waits for the first task of the futures to return, then cancels the
+// others: tasks not started yet never run, and running ones see
+// prethd_cancelled() return true. Called from a task of the pool, the
+// calling thread runs other queued tasks of its class while waiting.
+//
+// PARAMS:
+// futs - the futures to wait for
+// n    - number of futures
+// ret  - receives the value returned by the first task, can be NULL
+//
+// RETURN:
+// The index of the first future whose task returned, or n on error or if
+// every task was cancelled before it started.
+size_t prethd_when_any(prethd_future_t **futs, size_t n, void **ret) {
+    if (futs == NULL || n == 0 || !fut_wait(futs, n, true))
+        return n;
+
+    size_t win = n;
+    for (size_t i = 0; i < n && win == n; i++)
+        if (__atomic_load_n(&futs[i]->state, __ATOMIC_ACQUIRE) == FUT_DONE)
+            win = i;
+    for (size_t i = 0; i < n; i++)
+        if (i != win)
+            prethd_future_cancel(futs[i]);
+    if (win < n && ret != NULL)
+        *ret = futs[win]->ret;
+    return win;
+}
+
+// Sets up a frame for a task of the pool to spawn subtasks in, which
+// must be ended with prethd_sync() before the task returns.
+//
+// PARAMS:
+// th    - the thread pool running the task
+// frame - the frame to set up, usually on the stack of the task
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_frame(prethd_t *th, prethd_frame_t *frame) {
+    if (th == NULL || frame == NULL)
+        return false;
+
+    frame->pool = th;
+    frame->pending = 0;
+    pthread_mutex_init(&frame->mut, NULL);
+    pthread_cond_init(&frame->cond, NULL);
+    return true;
+}
+
+// Spawns a subtask in a frame. The calling thread pushes it onto its own
+// deque and goes on with the rest of the task, while idle threads of its
+// class steal the oldest subtasks, which are the largest ones in divide
+// and conquer. Outside the pool's threads, the subtask is run at once.
+//
+// PARAMS:
+// frame - the frame of the calling task
+// func  - function to run
+// arg   - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_spawn(prethd_frame_t *frame, void *(*func)(void *), void *arg) {
+    if (frame == NULL || func == NULL)
+        return false;
+
+    struct worker_t *w = self_get(frame->pool);
+    if (w == NULL) {
+        func(arg);
+        return true;
+    }
+
+    size_t tid = 0;
+    if (__atomic_load_n(&frame->pool->trace, __ATOMIC_RELAXED))
+        tid = trace_add(frame->pool, w);
+    pthread_mutex_lock(&w->dmut);
+    if (w->dbot == w->dcap) {
+        size_t cap = (w->dcap == 0) ? 16 : w->dcap * 2;
+        struct spawn_t *dq = realloc(w->dq, cap * (sizeof *dq));
+        if (dq == NULL) {
+            pthread_mutex_unlock(&w->dmut);
+            func(arg);      // no room, run it at once
+            return true;
+        }
+        w->dq = dq;
+        w->dcap = cap;
+    }
+    w->dq[w->dbot].func = func;
+    w->dq[w->dbot].arg = arg;
+    w->dq[w->dbot].frame = frame;
+    w->dq[w->dbot].tid = tid;
+    w->dq[w->dbot].tag = w->tag;
+    pthread_mutex_lock(&frame->mut);
+    frame->pending++;
+    pthread_mutex_unlock(&frame->mut);
+    w->dbot++;
+    pthread_mutex_unlock(&w->dmut);
+    sem_post(&w->exec->qsem);
+    return true;
+}
+
+// Waits for the subtasks spawned in a frame and ends the frame. The
+// calling thread runs the subtasks nobody stole, newest first, then runs
+// other tasks of its class while the stolen ones finish. As each thread
+// only keeps the subtasks of the frames it is in, memory use is bounded
+// by the depth of the recursion.
+//
+// PARAMS:
+// frame - the frame of the calling task
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sync(prethd_frame_t *frame) {
+    if (frame == NULL)
+        return false;
+
+    struct worker_t *w = self_get(frame->pool);
+    _Bool traced = w != NULL && w->tid > 0;
+    double wait = traced ? now() : 0, onest = traced ? w->tnest : 0;
+    if (w != NULL) {
+        struct spawn_t sp;
+        for (;;) {
+            pthread_mutex_lock(&w->dmut);
+            _Bool own = w->dbot > w->dtop && w->dq[w->dbot - 1].frame == frame;
+            if (own) {
+                sp = w->dq[--w->dbot];
+                if (w->dbot == w->dtop) {
+                    w->dtop = 0;
+                    w->dbot = 0;
+                }
+            }
+            pthread_mutex_unlock(&w->dmut);
+            if (!own)
+                break;
+            // Its token is left posted, as a thief may already be awake on
+            // it; a thread finding nothing for a token just waits again.
+            spawn_run(w->pool, w, &sp);
+        }
+    }
+
+    pthread_mutex_lock(&frame->mut);
+    while (frame->pending > 0) {
+        pthread_mutex_unlock(&frame->mut);
+        _Bool ran = false;
+        if (w != NULL && sem_trywait(&w->exec->qsem) == 0) {
+            ran = task_next(w->pool, w);
+            if (!ran)
+                sem_post(&w->exec->qsem);   // not ours, e.g. a stop token
+        }
+        pthread_mutex_lock(&frame->mut);
+        if (!ran && frame->pending > 0)
+            pthread_cond_wait(&frame->cond, &frame->mut);
+    }
+    pthread_mutex_unlock(&frame->mut);
+    pthread_mutex_destroy(&frame->mut);
+    pthread_cond_destroy(&frame->cond);
+    if (traced)     // not work of the task, whatever ran meanwhile
+        w->tnest = onest + now() - wait;
+    return true;
+}
+
+// Allocates an empty ordered map from 64-bit keys to pointers, safe for
+// any number of threads to use at once without locking. Removed entries
+// are reclaimed through the pool once no thread can still be reading
+// them, so the pool must outlive the map.
+//
+// PARAMS:
+// th - the thread pool reclaiming removed entries
+//
+// RETURN:
+// The map, or NULL on error.
+prethd_skip_t *prethd_skip_new(prethd_t *th) {
+    if (th == NULL)
+        return NULL;
+
+    prethd_skip_t *s = malloc(sizeof *s);
+    if (s == NULL)
+        return NULL;
+    s->pool = th;
+    s->seed = (uint64_t)(uintptr_t)s ^ th->seed;
+    s->head = calloc(1, sizeof *s->head + SKIP_LEVELS * (sizeof
+        *s->head->next));
+    if (s->head == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->head->height = SKIP_LEVELS;
+    return s;
+}
+
+// Adds an entry to a map, unless its key is in the map already.
+//
+// PARAMS:
+// s   - the map to add to
+// key - key of the entry
+// val - value of the entry
+//
+// RETURN:
+// 1 (true) if the entry was added, 0 (false) on error or if the key was
+// in the map.
+_Bool prethd_skip_insert(prethd_skip_t *s, uint64_t key, void *val) {
+    if (s == NULL)
+        return false;
+
+    size_t h = skip_height(s, key);
+    struct skip_node_t *n = malloc(sizeof *n + h * (sizeof *n->next));
+    if (n == NULL)
+        return false;
+    n->rn.free = free;
+    n->key = key;
+    n->val = val;
+    n->height = h;
+    n->refs = 1;        // held by this thread until fully linked
+
+    struct skip_node_t *preds[SKIP_LEVELS], *succs[SKIP_LEVELS];
+    size_t e = ebr_enter(s->pool);
+    for (;;) {
+        if (skip_search(s, key, preds, succs)) {
+            ebr_exit(s->pool, e);
+            free(n);
+            return false;
+        }
+        for (size_t i = 0; i < h; i++)
+            n->next[i] = (uintptr_t)succs[i];
+        __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+        uintptr_t exp = (uintptr_t)succs[0];
+        if (__atomic_compare_exchange_n(preds[0]->next, &exp, (uintptr_t)n,
+                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            break;
+        __atomic_sub_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    // Link the upper levels, unless the entry is removed meanwhile.
+    for (size_t i = 1; i < h; i++) {
+        for (;;) {
+            uintptr_t old = __atomic_load_n(n->next + i, __ATOMIC_ACQUIRE);
+            if ((old & 1) || (old != (uintptr_t)succs[i] &&
+                    !__atomic_compare_exchange_n(n->next + i, &old,
+                    (uintptr_t)succs[i], false, __ATOMIC_RELEASE,
+                    __ATOMIC_RELAXED)))
+                break;
+            __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+            uintptr_t exp = (uintptr_t)succs[i];
+            if (__atomic_compare_exchange_n(preds[i]->next + i, &exp,
+                    (uintptr_t)n, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                break;
+            __atomic_sub_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+            skip_search(s, key, preds, succs);
+            if (succs[0] != n)
+                goto linked;    // removed meanwhile
+        }
+        if (__atomic_load_n(n->next + i, __ATOMIC_ACQUIRE) & 1)
+            break;
+    }
+linked:
+    skip_drop(s, n);
+    ebr_exit(s->pool, e);
+    return true;
+}
+
+// Removes the entry with the given key from a map.
+//
+// PARAMS:
+// s   - the map to remove from
+// key - key of the entry
+// val - receives the value of the entry, can be NULL
+//
+// RETURN:
+// 1 (true) if the entry was removed, 0 (false) on error or if the key was
+// not in the map.
+_Bool prethd_skip_erase(prethd_skip_t *s, uint64_t key, void **val) {
+    if (s == NULL)
+        return false;
+
+    struct skip_node_t *preds[SKIP_LEVELS], *succs[SKIP_LEVELS];
+    size_t e = ebr_enter(s->pool);
+    if (!skip_search(s, key, preds, succs)) {
+        ebr_exit(s->pool, e);
+        return false;
+    }
+
+    // Mark the links top down; whoever marks the bottom one removes it.
+    struct skip_node_t *n = succs[0];
+    for (size_t i = n->height; i-- > 1;)
+        __atomic_fetch_or(n->next + i, 1, __ATOMIC_ACQ_REL);
+    uintptr_t old = __atomic_fetch_or(n->next, 1, __ATOMIC_ACQ_REL);
+    if (!(old & 1)) {
+        if (val != NULL)
+            *val = n->val;
+        skip_search(s, key, preds, succs);      // unlinks it
+    }
+    ebr_exit(s->pool, e);
+    return !(old & 1);
+}
+
+// Looks up the entry with the given key in a map.
+//
+// PARAMS:
+// s   - the map to look in
+// key - key of the entry
+// val - receives the value of the entry, can be NULL
+//
+// RETURN:
+// 1 (true) if the key is in the map, 0 (false) on error or otherwise.
+_Bool prethd_skip_find(prethd_skip_t *s, uint64_t key, void **val) {
+    if (s == NULL)
+        return false;
+
+    struct skip_node_t *preds[SKIP_LEVELS], *succs[SKIP_LEVELS];
+    size_t e = ebr_enter(s->pool);
+    _Bool ret = skip_search(s, key, preds, succs);
+    if (ret && val != NULL)
+        *val = succs[0]->val;
+    ebr_exit(s->pool, e);
+    return ret;
+}
+
+// Calls a function on the entries of a map with keys from lo up to but
+// excluding hi, in key order. Entries added or removed during the scan
+// may or may not be seen. Removed entries are not reclaimed while a scan
+// is running, so the function should not block.
+//
+// PARAMS:
+// s   - the map to scan
+// lo  - lowest key to visit
+// hi  - key to stop before
+// fn  - called on each entry, returns 0 (false) to stop the scan
+// ctx - argument for fn
+//
+// RETURN:
+// The number of entries visited.
+size_t prethd_skip_range(prethd_skip_t *s, uint64_t lo, uint64_t hi,
+        _Bool (*fn)(uint64_t key, void *val, void *ctx), void *ctx) {
+    if (s == NULL || fn == NULL || lo >= hi)
+        return 0;
+
+    struct skip_node_t *preds[SKIP_LEVELS], *succs[SKIP_LEVELS];
+    size_t ret = 0, e = ebr_enter(s->pool);
+    skip_search(s, lo, preds, succs);
+    for (struct skip_node_t *n = succs[0]; n != NULL && n->key < hi;) {
+        uintptr_t next = __atomic_load_n(n->next, __ATOMIC_ACQUIRE);
+        if (!(next & 1)) {
+            ret++;
+            if (!fn(n->key, n->val, ctx))
+                break;
+        }
+        n = (struct skip_node_t *)(next & ~(uintptr_t)1);
+    }
+    ebr_exit(s->pool, e);
+    return ret;
+}
+
+// Frees a map. No other thread may be using it.
+//
+// PARAMS:
+// s - the map to free
+void prethd_skip_free(prethd_skip_t *s) {
+    if (s == NULL)
+        return;
+
+    // Each entry is freed at the lowest level it is still linked at.
+    for (size_t i = SKIP_LEVELS; i-- > 0;) {
+        uintptr_t p = s->head->next[i];
+        while (p & ~(uintptr_t)1) {
+            struct skip_node_t *n = (struct skip_node_t *)(p & ~(uintptr_t)1);
+            p = n->next[i];
+            if (--n->refs == 0)
+                free(n);
+        }
+    }
+    free(s->head);
+    free(s);
+}
+
+// Frees the specified thread pool.
+//
+// PARAMS:
+// th - the thread pool to free
+void prethd_free(prethd_t *th) {
+    if (th != NULL) {
+        reg_del(th);
+        des_pool(th);
+    }
+}
+
+// Frees the specified thread pool. Waits for all threads to join before
+// freeing. If they cannot be joined, e.g. pthread_join() fails, the pool
+// is leaked rather than freed under threads that may still use it.
+//
+// PARAMS:
+// th - the thread pool to free
+void prethd_join_free(prethd_t *th) {
+    if (th != NULL && prethd_join(th)) {
+        reg_del(th);
+        des_pool(th);
+    }
+}
+
+// Returns an array of mutexes.
+//
+// PARAMS:
+// n - the number of mutexes to create
+//
+// RETURN:
+// The array of mutexes, or NULL on error.
+static pthread_mutex_t *init_muts(size_t n) {
+    if (n == 0)
+        return NULL;
+
+    pthread_mutex_t *mut = malloc(n * (sizeof *mut));
+    if (mut != NULL)
+        for (size_t i = 0; i < n; i++)
+            pthread_mutex_init(mut + i, NULL);
+    return mut;
+}
+
+// Destroyes the array of mutexes.
+//
+// PARAMS:
+// muts - the array of mutexes to destroy
+// n    - the count of mutexes
+static void des_muts(pthread_mutex_t *muts, size_t n) {
+    if (muts != NULL && n > 0) {
+        for (size_t i = 0; i < n; i++)
+            pthread_mutex_destroy(muts + i);
+        free(muts);
+    }
+}
+
+// Returns an array of conditional variables.
+//
+// PARAMS:
+// n - the number of conditional variables to create
+//
+// RETURN:
+// The array of conditional variables, or NULL on error.
+static pthread_cond_t *init_conds(size_t n) {
+    if (n == 0)
+        return NULL;
+
+    pthread_cond_t *cond = malloc(n * (sizeof *cond));
+    if (cond != NULL)
+        for (size_t i = 0; i < n; i++)
+            pthread_cond_init(cond + i, NULL);
+    return cond;
+}
+
+// Destroyes the array of conditional variables.
+//
+// PARAMS:
+// conds - the conditional variables to destroy
+// n     - the count of conditional variables
+static void des_conds(pthread_cond_t *conds, size_t n) {
+    if (conds != NULL && n > 0) {
+        for (size_t i = 0; i < n; i++)
+            pthread_cond_destroy(conds + i);
+        free(conds);
+    }
+}
+
+// Returns an array of counting semaphores.
+//
+// PARAMS:
+// values - initial permit count of each semaphore
+// n      - the number of semaphores to create
+//
+// RETURN:
+// The array of semaphores, or NULL on error.
+static struct psem_t *init_sems(const unsigned *values, size_t n) {
+    struct psem_t *sems = malloc(n * (sizeof *sems));
+    if (sems == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < n; i++) {
+        if (sem_init(&sems[i].sem, 0, values[i]) != 0) {
+            des_sems(sems, i);
+            return NULL;
+        }
+        pthread_mutex_init(&sems[i].bmut, NULL);
+        sems[i].phead = NULL;
+        sems[i].ptail = NULL;
+        sems[i].plen = 0;
+    }
+    return sems;
+}
+
+// Destroyes the array of counting semaphores, including parked tasks.
+//
+// PARAMS:
+// sems - the array of semaphores to destroy
+// n    - the count of semaphores
+static void des_sems(struct psem_t *sems, size_t n) {
+    if (sems == NULL)
+        return;
+
+    for (size_t i = 0; i < n; i++) {
+        for (struct bulk_t *b = sems[i].phead, *next; b != NULL; b = next) {
+            next = b->next;
+            free(b);
+        }
+        sem_destroy(&sems[i].sem);
+        pthread_mutex_destroy(&sems[i].bmut);
+    }
+    free(sems);
+}
+
+// Destroyes the pool and everything it owns, including queued tasks.
+//
+// PARAMS:
+// th - the thread pool to destroy
+static void des_pool(prethd_t *th) {
+    des_muts(th->muts, th->mlen);
+    des_conds(th->conds, th->clen);
+    des_sems(th->sems, th->slen);
+    des_execs(th->execs, th->elen);
+    free(th->ring);
+    free(th->res);
+    free(th->resv);
+    free(th->cpus);
+    free(th->tnodes);
+    free(th->tedges);
+    pthread_mutex_destroy(&th->tmut);
+    pthread_mutex_destroy(&th->lmut);
+    pthread_mutex_destroy(&th->xmut);
+    pthread_cond_destroy(&th->xcond);
+    free(th->ltab.slots);
+    free(th->ltab.used);
+    for (size_t i = 0; i < th->len; i++) {
+        pthread_mutex_destroy(&th->workers[i].dmut);
+        pthread_mutex_destroy(&th->workers[i].amut);
+        free(th->workers[i].dq);
+        free(th->workers[i].atab.slots);
+        free(th->workers[i].atab.used);
+    }
+    for (size_t i = 0; i < 3; i++) {
+        for (struct ebr_node_t *n = th->limbo[i], *next; n != NULL; n = next) {
+            next = n->next;
+            n->free(n);
+        }
+    }
+    free(th->workers);
+    free(th->threads);
+    free(th);
+}
+
+// Returns an array of executor classes.
+//
+// PARAMS:
+// names - name of each class, or NULL for a single class named "default"
+// sizes - number of threads in each class
+// n     - the number of classes to create
+//
+// RETURN:
+// The array of executor classes, or NULL on error.
+static struct exec_t *init_execs(const char **names, const size_t *sizes,
+        size_t n) {
+    struct exec_t *execs = malloc(n * (sizeof *execs));
+    if (execs == NULL)
+        return NULL;
+
+    size_t first = 0;
+    for (size_t i = 0; i < n; i++) {
+        const char *name = (names == NULL) ? "default" : names[i];
+        execs[i].name = malloc(strlen(name) + 1);
+        if (execs[i].name == NULL) {
+            des_execs(execs, i);
+            return NULL;
+        }
+        strcpy(execs[i].name, name);
+        execs[i].first = first;
+        execs[i].len = sizes[i];
+        execs[i].qhead = NULL;
+        execs[i].qtail = NULL;
+        execs[i].qlen = 0;
+        execs[i].smap = NULL;
+        execs[i].sfd = -1;
+        execs[i].scap = 0;
+        execs[i].shead = 0;
+        execs[i].stail = 0;
+        execs[i].swrap = 0;
+        execs[i].slen = 0;
+        execs[i].ohead = NULL;
+        execs[i].otail = NULL;
+        execs[i].olen = 0;
+        execs[i].hiwat = 0;
+        execs[i].cmax = 0;
+        execs[i].idle = 0;
+        pthread_mutex_init(&execs[i].qmut, NULL);
+        sem_init(&execs[i].qsem, 0, 0);
+        first += sizes[i];
+    }
+    return execs;
+}
+
+// Destroyes the array of executor classes, including queued tasks.
+//
+// PARAMS:
+// execs - the array of executor classes to destroy
+// n     - the count of executor classes
+static void des_execs(struct exec_t *execs, size_t n) {
+    if (execs == NULL)
+        return;
+
+    for (size_t i = 0; i < n; i++) {
+        spill_close(execs + i);
+        for (struct task_t *t = execs[i].qhead, *next; t != NULL; t = next) {
+            next = t->next;
+            free(t);
+        }
+        pthread_mutex_destroy(&execs[i].qmut);
+        sem_destroy(&execs[i].qsem);
+        free(execs[i].name);
+    }
+    free(execs);
+}
+
+// Task loop run by the threads of a started pool. Waits for a task of the
+// thread's executor class, runs it, and returns once the pool is stopped
+// and nothing is left to run.
+//
+// PARAMS:
+// arg - the worker state of the thread
+//
+// RETURN:
+// NULL.
+static void *task_loop(void *arg) {
+    struct worker_t *w = arg;
+    prethd_t *th = w->pool;
+    struct exec_t *ex = w->exec;
+    pthread_setspecific(self_key, w);
+    for (;;) {
+        if (__atomic_load_n(&th->share, __ATOMIC_RELAXED))
+            share_wait(th, w);
+        else
+            while (sem_wait(&ex->qsem) != 0)
+                ;   // interrupted by a signal
+        if (!task_next(th, w) && __atomic_load_n(&th->stop, __ATOMIC_ACQUIRE))
+            break;
+    }
+    res_clear(th, w);
+    pthread_setspecific(self_key, NULL);
+
+    pthread_mutex_lock(&th->xmut);
+    if (--th->live == 0)
+        pthread_cond_broadcast(&th->xcond);
+    pthread_mutex_unlock(&th->xmut);
+    return NULL;
+}
+
+// Drops every task waiting in the pool: queued, spilled, submitted from
+// a signal handler or parked behind a bulkhead.
+//
+// PARAMS:
+// th - the thread pool to drop the tasks of
+static void drop_tasks(prethd_t *th) {
+    struct task_t rt;
+    while (ring_pop(th, &rt))
+        ;
+    for (size_t i = 0; i < th->elen; i++) {
+        struct exec_t *ex = th->execs + i;
+        pthread_mutex_lock(&ex->qmut);
+        spill_get(ex, (size_t)-1);
+        if (ex->slen > 0) {     // out of memory, drop the rest unread
+            ex->slen = 0;
+            ex->swrap = 0;
+            spill_get(ex, 0);
+        }
+        struct task_t *t = ex->qhead;
+        ex->qhead = NULL;
+        ex->qtail = NULL;
+        ex->qlen = 0;
+        pthread_mutex_unlock(&ex->qmut);
+        for (struct task_t *next; t != NULL; t = next) {
+            next = t->next;
+            task_drop(t->func, t->arg);
+            free(t);
+        }
+    }
+    for (size_t i = 0; i < th->slen; i++) {
+        struct psem_t *ps = th->sems + i;
+        pthread_mutex_lock(&ps->bmut);
+        struct bulk_t *b = ps->phead;
+        ps->phead = NULL;
+        ps->ptail = NULL;
+        __atomic_store_n(&ps->plen, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ps->bmut);
+        for (struct bulk_t *next; b != NULL; b = next) {
+            next = b->next;
+            free(b);
+        }
+    }
+}
+
+// Creates and starts the default pool. Called once through pthread_once().
+static void def_init(void) {
+    size_t n = 0;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) == 0)
+        n = (size_t)CPU_COUNT(&set);
+    if (n == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = (cpus > 0) ? (size_t)cpus : 1;
+    }
+
+    prethd_t *th = prethd_new(n, 0, 0);
+    if (th == NULL)
+        return;
+    if (prethd_start(th) == 0 || atexit(def_exit) != 0) {
+        prethd_join_free(th);
+        return;
+    }
+    def_pool = th;
+}
+
+// Joins and frees the default pool at exit().
+static void def_exit(void) {
+    prethd_t *th = def_pool;
+    def_pool = NULL;
+    prethd_join_free(th);
+}
+
+// Creates the key holding the worker state of the calling thread. Called
+// once through pthread_once().
+static void self_init(void) {
+    pthread_key_create(&self_key, NULL);
+}
+
+// Returns the worker state of the calling thread.
+//
+// PARAMS:
+// th - the thread pool the thread should belong to
+//
+// RETURN:
+// The worker state, or NULL if the calling thread is not running the task
+// loop of the pool.
+static struct worker_t *self_get(prethd_t *th) {
+    if (th == NULL)
+        return NULL;
+
+    struct worker_t *w = self_any();
+    return (w == NULL || w->pool != th) ? NULL : w;
+}
+
+// Returns the worker state of the calling thread, whichever pool it
+// belongs to. Tasks lent by another pool keep their running state here.
+//
+// RETURN:
+// The worker state, or NULL if the calling thread is not running the task
+// loop of any pool.
+static struct worker_t *self_any(void) {
+    pthread_once(&self_once, self_init);
+    return pthread_getspecific(self_key);
+}
+
+// Creates a thread of the pool, pinned to its CPU and with the stack set
+// by prethd_stack() if the pool has any.
+//
+// PARAMS:
+// th   - the thread pool
+// i    - index of the thread
+// func - function for the thread to run
+// arg  - argument for the function
+//
+// RETURN:
+// 0 on success, or the error from pthread_create().
+static int thd_create(prethd_t *th, size_t i, void *(*func)(void *),
+        void *arg) {
+    if (th->cpus == NULL && th->stack == 0 && th->guard == SIZE_MAX)
+        return pthread_create(th->threads + i, NULL, func, arg);
+
+    pthread_attr_t attr;
+    int ret = pthread_attr_init(&attr);
+    if (ret != 0)
+        return ret;
+    if (th->cpus != NULL) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(th->cpus[i % th->ncpus], &set);
+        ret = pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+    }
+    if (ret == 0 && th->stack > 0)
+        ret = pthread_attr_setstacksize(&attr, th->stack);
+    if (ret == 0 && th->guard != SIZE_MAX)
+        ret = pthread_attr_setguardsize(&attr, th->guard);
+    if (ret == 0)
+        ret = pthread_create(th->threads + i, &attr, func, arg);
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+// Runs the next task of the calling thread's executor class, once a
+// token of the class semaphore has been taken. Subtasks spawned by other
+// threads of the class are stolen once its queue is empty.
+//
+// PARAMS:
+// th - the thread pool running the task
+// w  - the worker state of the calling thread
+//
+// RETURN:
+// 1 (true) if a task was run, 0 (false) if none was waiting.
+static _Bool task_next(prethd_t *th, struct worker_t *w) {
+    struct task_t rt, *t;
+    if (w->exec == th->execs && ring_pop(th, &rt)) {
+        // Traced from here, as a signal handler cannot take the trace mutex.
+        rt.size = 0;
+        rt.tid = 0;
+        rt.tag = 0;
+        if (__atomic_load_n(&th->trace, __ATOMIC_RELAXED))
+            rt.tid = trace_add(th, NULL);
+        task_exec(th, w, &rt);
+        return true;
+    }
+    if ((t = task_pop(w->exec)) != NULL) {
+        task_run(th, w, t);
+        return true;
+    }
+    return spawn_steal(th, w);
+}
+
+// Steals the oldest subtask spawned by another thread of the calling
+// thread's executor class and runs it.
+//
+// PARAMS:
+// th - the thread pool running the task
+// w  - the worker state of the calling thread
+//
+// RETURN:
+// 1 (true) if a subtask was run, 0 (false) if none was waiting.
+static _Bool spawn_steal(prethd_t *th, struct worker_t *w) {
+    struct exec_t *ex = w->exec;
+    for (size_t i = 1; i < ex->len; i++) {
+        struct worker_t *v = th->workers + ex->first +
+            (w->id - ex->first + i) % ex->len;
+        struct spawn_t sp;
+        pthread_mutex_lock(&v->dmut);
+        _Bool found = v->dbot > v->dtop;
+        if (found) {
+            sp = v->dq[v->dtop++];
+            if (v->dbot == v->dtop) {
+                v->dtop = 0;
+                v->dbot = 0;
+            }
+        }
+        pthread_mutex_unlock(&v->dmut);
+        if (found) {
+            spawn_run(th, w, &sp);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs a spawned subtask like a queued task and tells its frame once
+// done.
+//
+// PARAMS:
+// th - the thread pool running the subtask
+// w  - the worker state of the calling thread
+// sp - the subtask
+static void spawn_run(prethd_t *th, struct worker_t *w, struct spawn_t *sp) {
+    prethd_frame_t *frame = sp->frame;
+    struct task_t t;
+    t.func = sp->func;
+    t.arg = sp->arg;
+    t.size = 0;
+    t.tid = sp->tid;
+    t.tag = sp->tag;
+    task_exec(th, w, &t);
+    pthread_mutex_lock(&frame->mut);
+    if (--frame->pending == 0)
+        pthread_cond_broadcast(&frame->cond);
+    pthread_mutex_unlock(&frame->mut);
+}
+
+// Takes a token of the class semaphore of the calling thread, which
+// belongs to a sharing pool. Until one is posted, runs tasks lent by other
+// sharing pools, and waits counted as idle once there are none, so that
+// they wake it when they run short of threads.
+//
+// PARAMS:
+// th - the thread pool of the calling thread
+// w  - the worker state of the calling thread
+static void share_wait(prethd_t *th, struct worker_t *w) {
+    struct exec_t *ex = w->exec;
+    while (sem_trywait(&ex->qsem) != 0) {
+        // Counted before looking, so a task queued meanwhile is seen by
+        // share_take() or wakes the thread.
+        prethd_t *from;
+        __atomic_add_fetch(&ex->idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&share_idle, 1, __ATOMIC_SEQ_CST);
+        struct task_t *t = share_take(th, &from);
+        if (t == NULL)
+            while (sem_wait(&ex->qsem) != 0)
+                ;   // interrupted by a signal
+        __atomic_sub_fetch(&share_idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&ex->idle, 1, __ATOMIC_SEQ_CST);
+        if (t == NULL)
+            return;
+        task_run(from, w, t);
+        share_return(from);
+    }
+}
+
+// Takes a task queued in another sharing pool that none of its threads
+// has a token for yet. The token is taken along with the task, and put
+// back if the queue turns out empty.
+//
+// PARAMS:
+// th   - the thread pool of the calling thread
+// from - receives the pool the task was queued in
+//
+// RETURN:
+// The task, to be run then given back with share_return(), or NULL if
+// there is none.
+static struct task_t *share_take(prethd_t *th, prethd_t **from) {
+    if (__atomic_load_n(&th->stop, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    struct task_t *t = NULL;
+    pthread_mutex_lock(&reg_mut);
+    for (prethd_t *p = reg_head; p != NULL && t == NULL; p = p->next) {
+        if (p == th || !p->share ||
+                !__atomic_load_n(&p->tasks, __ATOMIC_ACQUIRE))
+            continue;
+        for (size_t i = 0; i < p->elen && t == NULL; i++) {
+            struct exec_t *ex = p->execs + i;
+            if (sem_trywait(&ex->qsem) != 0)
+                continue;
+            // Lent before taken, so a shutdown finding the queue empty
+            // waits for the task.
+            __atomic_add_fetch(&p->lent, 1, __ATOMIC_SEQ_CST);
+            t = task_pop(ex);
+            if (t == NULL) {
+                sem_post(&ex->qsem);
+                share_return(p);
+            }
+        }
+        if (t != NULL)
+            *from = p;
+    }
+    pthread_mutex_unlock(&reg_mut);
+    return t;
+}
+
+// Gives a task taken with share_take() back to its pool once run.
+//
+// PARAMS:
+// th - the thread pool the task was queued in
+static void share_return(prethd_t *th) {
+    pthread_mutex_lock(&th->xmut);
+    if (__atomic_sub_fetch(&th->lent, 1, __ATOMIC_SEQ_CST) == 0)
+        pthread_cond_broadcast(&th->xcond);
+    pthread_mutex_unlock(&th->xmut);
+}
+
+// Wakes an idle thread of another sharing pool to take a task of the given
+// pool.
+//
+// PARAMS:
+// th - the thread pool short of threads
+static void share_wake(prethd_t *th) {
+    if (__atomic_load_n(&share_idle, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    pthread_mutex_lock(&reg_mut);
+    for (prethd_t *p = reg_head; p != NULL; p = p->next) {
+        if (p == th || !p->share ||
+                !__atomic_load_n(&p->tasks, __ATOMIC_ACQUIRE))
+            continue;
+        for (size_t i = 0; i < p->elen; i++) {
+            if (__atomic_load_n(&p->execs[i].idle, __ATOMIC_SEQ_CST) > 0) {
+                sem_post(&p->execs[i].qsem);
+                pthread_mutex_unlock(&reg_mut);
+                return;
+            }
+        }
+    }
+    pthread_mutex_unlock(&reg_mut);
+}
+
+// Wakes threads waiting on one side of a bounded queue after k items or
+// slots became available: none if no thread is waiting, one per item if
+// fewer items than waiters, all otherwise.
+//
+// PARAMS:
+// cond    - the conditional variable the threads wait on
+// waiting - number of threads waiting
+// k       - number of items or slots now available
+static void bq_wake(pthread_cond_t *cond, size_t waiting, size_t k) {
+    if (waiting == 0 || k == 0)
+        return;
+    if (k >= waiting) {
+        pthread_cond_broadcast(cond);
+    } else {
+        for (size_t i = 0; i < k; i++)
+            pthread_cond_signal(cond);
+    }
+}
+
+// Enters a reclamation critical section, in which memory retired by other
+// threads is not freed. Pool threads announce the epoch in their own
+// slot; other threads count themselves in the epoch's shared counter.
+// Sections may nest.
+//
+// PARAMS:
+// th - the thread pool reclaiming the memory
+//
+// RETURN:
+// The epoch entered, to be given to ebr_exit().
+static size_t ebr_enter(prethd_t *th) {
+    struct worker_t *w = self_get(th);
+    size_t e;
+    if (w != NULL && w->edepth++ > 0)
+        return w->epoch >> 1;
+    for (;;) {
+        e = __atomic_load_n(&th->epoch, __ATOMIC_SEQ_CST);
+        if (w != NULL)
+            __atomic_store_n(&w->epoch, e * 2 + 1, __ATOMIC_SEQ_CST);
+        else
+            __atomic_add_fetch(th->eout + e % 3, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&th->epoch, __ATOMIC_SEQ_CST) == e)
+            return e;
+        if (w == NULL)
+            __atomic_sub_fetch(th->eout + e % 3, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Leaves a reclamation critical section, and frees retired memory once
+// enough has piled up.
+//
+// PARAMS:
+// th - the thread pool reclaiming the memory
+// e  - the epoch returned by ebr_enter()
+static void ebr_exit(prethd_t *th, size_t e) {
+    struct worker_t *w = self_get(th);
+    if (w != NULL) {
+        if (--w->edepth > 0)
+            return;
+        __atomic_store_n(&w->epoch, 0, __ATOMIC_RELEASE);
+    } else {
+        __atomic_sub_fetch(th->eout + e % 3, 1, __ATOMIC_RELEASE);
+    }
+    if (__atomic_load_n(&th->epend, __ATOMIC_RELAXED) >= 64)
+        ebr_advance(th);
+}
+
+// Retires memory unlinked by the calling thread inside a reclamation
+// critical section, to be freed once no thread can still be reading it.
+//
+// PARAMS:
+// th - the thread pool reclaiming the memory
+// n  - the node to retire
+static void ebr_retire(prethd_t *th, struct ebr_node_t *n) {
+    n->tag = __atomic_load_n(&th->epoch, __ATOMIC_SEQ_CST);
+    struct ebr_node_t **head = th->limbo + n->tag % 3;
+    n->next = __atomic_load_n(head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(head, &n->next, n, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&th->epend, 1, __ATOMIC_RELAXED);
+}
+
+// Moves the reclamation epoch on if every thread in a critical section
+// has seen the current one, then frees the nodes retired two epochs ago.
+// Nodes are only freed by tag, so a list taken late is never freed early.
+//
+// PARAMS:
+// th - the thread pool reclaiming the memory
+static void ebr_advance(prethd_t *th) {
+    size_t e = __atomic_load_n(&th->epoch, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(th->eout + (e + 2) % 3, __ATOMIC_SEQ_CST) > 0)
+        return;
+    for (size_t i = 0; i < th->len; i++) {
+        size_t ep = __atomic_load_n(&th->workers[i].epoch, __ATOMIC_SEQ_CST);
+        if (ep != 0 && ep >> 1 != e)
+            return;
+    }
+    if (!__atomic_compare_exchange_n(&th->epoch, &e, e + 1, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return;
+
+    struct ebr_node_t *n = __atomic_exchange_n(th->limbo + (e + 2) % 3,
+        NULL, __ATOMIC_ACQUIRE);
+    for (struct ebr_node_t *next; n != NULL; n = next) {
+        next = n->next;
+        if (n->tag + 2 <= __atomic_load_n(&th->epoch, __ATOMIC_SEQ_CST)) {
+            n->free(n);
+            __atomic_sub_fetch(&th->epend, 1, __ATOMIC_RELAXED);
+        } else {
+            struct ebr_node_t **head = th->limbo + n->tag % 3;
+            n->next = __atomic_load_n(head, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(head, &n->next, n, true,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+        }
+    }
+}
+
+// Finds the entries of a map around a key at every level, unlinking the
+// removed entries it passes. Must be called in a reclamation critical
+// section.
+//
+// PARAMS:
+// s     - the map to search
+// key   - the key to search for
+// preds - receives the last entry before the key at each level
+// succs - receives the first entry at or after the key at each level
+//
+// RETURN:
+// 1 (true) if the key is in the map, 0 (false) otherwise.
+static _Bool skip_search(prethd_skip_t *s, uint64_t key,
+        struct skip_node_t **preds, struct skip_node_t **succs) {
+retry:;
+    struct skip_node_t *pred = s->head, *curr = NULL;
+    for (size_t i = SKIP_LEVELS; i-- > 0;) {
+        curr = (struct skip_node_t *)(__atomic_load_n(pred->next + i,
+            __ATOMIC_ACQUIRE) & ~(uintptr_t)1);
+        while (curr != NULL) {
+            uintptr_t succ = __atomic_load_n(curr->next + i,
+                __ATOMIC_ACQUIRE);
+            if (succ & 1) {
+                uintptr_t exp = (uintptr_t)curr;
+                if (!__atomic_compare_exchange_n(pred->next + i, &exp,
+                        succ & ~(uintptr_t)1, false, __ATOMIC_ACQ_REL,
+                        __ATOMIC_RELAXED))
+                    goto retry;     // pred changed or was removed
+                skip_drop(s, curr);
+                curr = (struct skip_node_t *)(succ & ~(uintptr_t)1);
+            } else if (curr->key < key) {
+                pred = curr;
+                curr = (struct skip_node_t *)succ;
+            } else {
+                break;
+            }
+        }
+        preds[i] = pred;
+        succs[i] = curr;
+    }
+    return curr != NULL && curr->key == key;
+}
+
+// Picks the height of a new entry, one more level with probability one
+// half each, from a counter of the pool thread or else from the key. The
+// thread's random stream is left to the tasks, see prethd_rng().
+//
+// PARAMS:
+// s   - the map to add to
+// key - key of the entry
+//
+// RETURN:
+// The height, between 1 and SKIP_LEVELS.
+static size_t skip_height(prethd_skip_t *s, uint64_t key) {
+    struct worker_t *w = self_get(s->pool);
+    uint64_t r = (w != NULL) ? w->hctr++ : key;
+    r ^= s->seed;               // splitmix64 finaliser
+    r = (r ^ (r >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    r = (r ^ (r >> 27)) * 0x94d049bb133111ebULL;
+    r ^= r >> 31;
+    size_t h = 1;
+    while (h < SKIP_LEVELS && (r & 1)) {
+        h++;
+        r >>= 1;
+    }
+    return h;
+}
+
+// Drops one link to a skiplist entry, retiring the entry with the last.
+//
+// PARAMS:
+// s - the map of the entry
+// n - the entry
+static void skip_drop(prethd_skip_t *s, struct skip_node_t *n) {
+    if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        ebr_retire(s->pool, &n->rn);
+}
+
+// Releases what a dropped task holds, for the tasks queued internally on
+// behalf of futures, parallel loops, bulkheads and coalesced tasks.
+//
+// PARAMS:
+// func - function of the dropped task
+// arg  - argument of the dropped task
+static void task_drop(void *(*func)(void *), void *arg) {
+    if (func == fut_run) {
+        int state = FUT_PENDING;
+        if (__atomic_compare_exchange_n(&((prethd_future_t *)arg)->state,
+                &state, FUT_CANCELLED, false, __ATOMIC_ACQ_REL,
+                __ATOMIC_ACQUIRE))
+            fut_finish(arg, FUT_CANCELLED);
+        prethd_future_free(arg);
+    } else if (func == par_help) {
+        par_put(arg);
+    } else if (func == batch_run) {
+        struct batch_t *b = arg;
+        for (size_t i = 0; i < b->len; i++)
+            task_drop(b->tasks[i].func, b->tasks[i].arg);
+    } else if (func == bulk_run) {
+        struct bulk_t *b = arg;
+        if (b->held)
+            prethd_sem_release(b->pool, b->s);
+        free(b);
+    }
+}
+
+// Runs a task taken off a queue and frees it.
+//
+// PARAMS:
+// th - the thread pool the task was queued in
+// w  - the worker state of the calling thread
+// t  - the task to run
+static void task_run(prethd_t *th, struct worker_t *w, struct task_t *t) {
+    task_exec(th, w, t);
+    free(t);
+}
+
+// Runs a task, recording its timings if it is traced and its time used if
+// accounting is on.
+//
+// PARAMS:
+// th - the thread pool the task was queued in
+// w  - the worker state of the calling thread
+// t  - the task to run
+static void task_exec(prethd_t *th, struct worker_t *w, struct task_t *t) {
+    size_t outer = w->tid;
+    uint64_t otag = w->tag;
+    _Bool acct = __atomic_load_n(&th->acct, __ATOMIC_RELAXED);
+    double cpu = 0, wall = 0, ocpu = w->acpu, owall = w->awall;
+    double tstart = 0, onest = w->tnest;
+    if (t->tid > 0) {
+        tstart = trace_time(th, t->tid, true, 0);
+        w->tnest = 0;
+    }
+    if (acct) {
+        w->acpu = 0;
+        w->awall = 0;
+        cpu = cpu_now();
+        wall = now();
+    }
+    w->tid = t->tid;
+    w->tag = t->tag;
+    t->func(t->arg);
+    w->tid = outer;
+    w->tag = otag;
+    if (acct) {
+        cpu = cpu_now() - cpu;
+        wall = now() - wall;
+        if (w->pool == th)
+            usage_add(&w->atab, &w->amut, t->tag, cpu - w->acpu,
+                wall - w->awall);
+        else    // lent, counted with its pool
+            usage_add(&th->ltab, &th->lmut, t->tag, cpu - w->acpu,
+                wall - w->awall);
+        w->acpu = ocpu + cpu;
+        w->awall = owall + wall;
+    }
+    if (t->tid > 0)     // nested in the outer task for its own trace
+        w->tnest = onest + trace_time(th, t->tid, false, w->tnest) - tstart;
+}
+
+// Adds a task queued by the calling thread to the trace.
+//
+// PARAMS:
+// th - the thread pool tracing the task
+// w  - the worker state of the calling thread, or NULL
+//
+// RETURN:
+// The trace id of the task, or 0 if not traced.
+static size_t trace_add(prethd_t *th, struct worker_t *w) {
+    size_t ret = 0;
+    pthread_mutex_lock(&th->tmut);
+    if (th->tlen == th->tcap) {
+        size_t cap = (th->tcap == 0) ? 256 : th->tcap * 2;
+        void *mem = realloc(th->tnodes, cap * (sizeof *th->tnodes));
+        if (mem != NULL) {
+            th->tnodes = mem;
+            th->tcap = cap;
+        }
+    }
+    if (th->trace && th->tlen < th->tcap) {
+        struct trace_node_t *node = th->tnodes + th->tlen;
+        node->parent = (w == NULL) ? 0 : w->tid;
+        node->spawn = now();
+        node->start = node->spawn;
+        node->end = node->spawn;
+        node->nest = 0;
+        ret = ++th->tlen;
+    }
+    pthread_mutex_unlock(&th->tmut);
+    return ret;
+}
+
+// Records the start or end time of a traced task.
+//
+// PARAMS:
+// th    - the thread pool tracing the task
+// tid   - trace id of the task
+// start - 1 (true) for the start time, 0 (false) for the end time
+// nest  - time the task spent in nested tasks and prethd_sync(), recorded
+//         with the end time
+//
+// RETURN:
+// The time recorded.
+static double trace_time(prethd_t *th, size_t tid, _Bool start,
+        double nest) {
+    double t = now();
+    pthread_mutex_lock(&th->tmut);
+    if (tid <= th->tlen) {
+        if (start)
+            th->tnodes[tid - 1].start = t;
+        else
+            th->tnodes[tid - 1].nest = nest;
+        th->tnodes[tid - 1].end = t;
+    }
+    pthread_mutex_unlock(&th->tmut);
+    return t;
+}
+
+// Orders dependencies by their dependent task, for qsort().
+static int trace_cmp(const void *a, const void *b) {
+    const struct trace_edge_t *x = a, *y = b;
+    return (x->to > y->to) - (x->to < y->to);
+}
+
+// Returns the current time of the monotonic clock.
+//
+// RETURN:
+// The time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Returns the CPU time used by the calling thread in seconds.
+//
+// RETURN:
+// The CPU time of the calling thread.
+static double cpu_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Adds the time used by a task to a usage table, that of the thread that
+// ran it or that of the lent tasks of its pool. If the table cannot grow
+// it keeps filling up, and once it is full the time of tasks with new
+// tags goes unaccounted.
+//
+// PARAMS:
+// tab  - the table
+// mut  - the mutex guarding the table
+// tag  - the tag of the task
+// cpu  - CPU time used
+// wall - wall time taken
+static void usage_add(struct usage_tab_t *tab, pthread_mutex_t *mut,
+        uint64_t tag, double cpu, double wall) {
+    pthread_mutex_lock(mut);
+    if (2 * (tab->len + 1) > tab->cap) {
+        size_t cap = (tab->cap == 0) ? 16 : tab->cap * 2;
+        prethd_usage_t *slots = malloc(cap * (sizeof *slots));
+        _Bool *used = calloc(cap, sizeof *used);
+        if (slots == NULL || used == NULL) {
+            free(slots);
+            free(used);
+            if (tab->len == tab->cap) {
+                pthread_mutex_unlock(mut);
+                return;
+            }
+        } else {
+            for (size_t i = 0; i < tab->cap; i++) {
+                if (!tab->used[i])
+                    continue;
+                size_t j = (size_t)(tab->slots[i].tag *
+                    0x9e3779b97f4a7c15ULL) & (cap - 1);
+                while (used[j])
+                    j = (j + 1) & (cap - 1);
+                slots[j] = tab->slots[i];
+                used[j] = true;
+            }
+            free(tab->slots);
+            free(tab->used);
+            tab->slots = slots;
+            tab->used = used;
+            tab->cap = cap;
+        }
+    }
+
+    size_t j = (size_t)(tag * 0x9e3779b97f4a7c15ULL) & (tab->cap - 1);
+    while (tab->used[j] && tab->slots[j].tag != tag)
+        j = (j + 1) & (tab->cap - 1);
+    if (!tab->used[j]) {
+        tab->used[j] = true;
+        tab->slots[j].tag = tag;
+        tab->slots[j].tasks = 0;
+        tab->slots[j].cpu = 0;
+        tab->slots[j].wall = 0;
+        tab->len++;
+    }
+    tab->slots[j].tasks++;
+    tab->slots[j].cpu += cpu;
+    tab->slots[j].wall += wall;
+    pthread_mutex_unlock(mut);
+}
+
+// Orders tag totals by tag, for qsort().
+static int usage_cmp(const void *a, const void *b) {
+    const prethd_usage_t *x = a, *y = b;
+    return (x->tag > y->tag) - (x->tag < y->tag);
+}
+
+// Destroys the per-thread resource instances of a worker.
+//
+// PARAMS:
+// th - the thread pool the resources are registered with
+// w  - the worker to destroy the instances of
+static void res_clear(prethd_t *th, struct worker_t *w) {
+    for (size_t i = 0; i < th->reslen; i++) {
+        if (w->res[i] != NULL && th->res[i].destroy != NULL)
+            th->res[i].destroy(w->res[i], th->res[i].ctx);
+        w->res[i] = NULL;
+    }
+}
+
+// Queues a task in its own queue entry, never coalesced: the pool's own
+// tasks may wait on each other or each need a thread.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// c    - the executor class index
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+static _Bool task_submit(prethd_t *th, size_t c, void *(*func)(void *),
+        void *arg) {
+    struct task_t *t = malloc(sizeof *t);
+    if (t == NULL)
+        return false;
+    t->func = func;
+    t->arg = arg;
+    t->size = 0;
+    t->tid = 0;
+    t->tag = 0;
+    return task_push(th, c, t);
+}
+
+// Queues a task for an executor class, spilling it to disk if the class
+// has a spill file and its queue is at the high-water mark. Once tasks
+// have spilled, new tasks follow them into the file, or are held back in
+// memory while it is full, so that the queue stays in submission order.
+// While the pool is being drained, only tasks
+// queued by threads of the same class are accepted, as those threads are
+// still there to run them.
+//
+// PARAMS:
+// th - the thread pool to queue the task in
+// c  - the executor class index
+// t  - the task to queue, freed on error or once spilled
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+static _Bool task_push(prethd_t *th, size_t c, struct task_t *t) {
+    struct exec_t *ex = th->execs + c;
+    struct worker_t *w = self_get(th);
+    _Bool spilled = false;
+    t->next = NULL;
+
+    // Traced before the queue is locked, as fork_prepare() takes the trace
+    // mutex first. A task refused below stays in the trace with no length.
+    if (__atomic_load_n(&th->trace, __ATOMIC_RELAXED))
+        t->tid = trace_add(th, w);
+    pthread_mutex_lock(&ex->qmut);
+    if (th->stop && (th->cancel || w == NULL || w->exec != ex)) {
+        pthread_mutex_unlock(&ex->qmut);
+        free(t);
+        return false;
+    }
+    if (ex->smap != NULL && (ex->qlen >= ex->hiwat || ex->slen > 0) &&
+            ex->ohead == NULL)
+        spilled = spill_put(ex, t);
+    if (!spilled && ex->slen > 0) {   // behind the spilled tasks
+        if (ex->otail == NULL)
+            ex->ohead = t;
+        else
+            ex->otail->next = t;
+        ex->otail = t;
+        ex->olen++;
+    } else if (!spilled) {
+        if (ex->qtail == NULL)
+            ex->qhead = t;
+        else
+            ex->qtail->next = t;
+        ex->qtail = t;
+        ex->qlen++;
+    }
+    pthread_mutex_unlock(&ex->qmut);
+    if (spilled)
+        free(t);
+    sem_post(&ex->qsem);
+    if (__atomic_load_n(&th->share, __ATOMIC_RELAXED)) {
+        int val = 0;
+        sem_getvalue(&ex->qsem, &val);
+        if ((size_t)val > __atomic_load_n(&ex->idle, __ATOMIC_SEQ_CST))
+            share_wake(th);     // more tasks than idle threads to take them
+    }
+    return true;
+}
+
+// Takes the first task off the queue of an executor class, reading
+// spilled tasks back once the queue has fallen to half the high-water
+// mark.
+//
+// PARAMS:
+// ex - the executor class to take from
+//
+// RETURN:
+// The task taken, or NULL if the queue is empty.
+static struct task_t *task_pop(struct exec_t *ex) {
+    pthread_mutex_lock(&ex->qmut);
+    if (ex->slen > 0 && ex->qlen <= ex->hiwat / 2)
+        spill_get(ex, ex->hiwat);
+    struct task_t *head = ex->qhead;
+    if (head != NULL) {
+        ex->qhead = head->next;
+        if (ex->qhead == NULL)
+            ex->qtail = NULL;
+        ex->qlen--;
+    }
+    pthread_mutex_unlock(&ex->qmut);
+    return head;
+}
+
+// Appends a task record to the spill file of an executor class. Records
+// go after the last one, or wrap around to the start of the file when
+// the end has no room left and the records read back have freed enough
+// space there. Must be called with the queue mutex held.
+//
+// PARAMS:
+// ex - the executor class to spill to
+// t  - the task to spill
+//
+// RETURN:
+// 1 (true) if the task was spilled, 0 (false) if the file is full.
+static _Bool spill_put(struct exec_t *ex, struct task_t *t) {
+    size_t need = sizeof(struct spill_rec_t) + t->size;
+    need = (need + SPILL_ALIGN - 1) & ~(size_t)(SPILL_ALIGN - 1);
+    if (ex->slen == 0) {
+        if (need > ex->scap)
+            return false;
+    } else if (ex->swrap > 0) {
+        if (need > ex->shead - ex->stail)
+            return false;       // wrapped, the free space ends at shead
+    } else if (need > ex->scap - ex->stail) {
+        if (need > ex->shead)
+            return false;
+        ex->swrap = ex->stail;  // no room left at the end, wrap around
+        ex->stail = 0;
+    }
+
+    struct spill_rec_t *rec = (struct spill_rec_t *)(ex->smap + ex->stail);
+    rec->func = t->func;
+    rec->arg = (t->size > 0) ? NULL : t->arg;
+    rec->size = t->size;
+    rec->tid = t->tid;
+    rec->tag = t->tag;
+    memcpy(rec + 1, t + 1, t->size);
+    ex->stail += need;
+    ex->slen++;
+    return true;
+}
+
+// Moves spilled task records back into the queue of an executor class,
+// until the queue holds upto tasks or the file is empty. Once the file is
+// empty the tasks held back behind it join the queue, and its disk space
+// is given back. Must be called with the queue mutex held.
+//
+// PARAMS:
+// ex   - the executor class to read back
+// upto - queue length to fill up to
+static void spill_get(struct exec_t *ex, size_t upto) {
+    while (ex->slen > 0 && ex->qlen < upto) {
+        struct spill_rec_t *rec = (struct spill_rec_t *)(ex->smap + ex->shead);
+        struct task_t *t = malloc(sizeof *t + rec->size);
+        if (t == NULL)
+            break;      // try again on the next pop
+        t->func = rec->func;
+        t->arg = (rec->size > 0) ? (void *)(t + 1) : rec->arg;
+        t->size = rec->size;
+        t->tid = rec->tid;
+        t->tag = rec->tag;
+        t->next = NULL;
+        memcpy(t + 1, rec + 1, rec->size);
+
+        size_t used = sizeof *rec + rec->size;
+        ex->shead += (used + SPILL_ALIGN - 1) & ~(size_t)(SPILL_ALIGN - 1);
+        ex->slen--;
+        if (ex->swrap > 0 && ex->shead == ex->swrap) {
+            ex->shead = 0;      // the rest starts over at the beginning
+            ex->swrap = 0;
+        }
+        if (ex->qtail == NULL)
+            ex->qhead = t;
+        else
+            ex->qtail->next = t;
+        ex->qtail = t;
+        ex->qlen++;
+    }
+
+    if (ex->slen == 0) {
+        spill_flush(ex);
+        if (ex->stail > 0)
+            fallocate(ex->sfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                (off_t)ex->scap);
+        ex->shead = 0;
+        ex->stail = 0;
+    }
+}
+
+// Moves the tasks held back behind a full spill file to the end of the
+// queue of an executor class. Must be called with the queue mutex held.
+//
+// PARAMS:
+// ex - the executor class to move the tasks of
+static void spill_flush(struct exec_t *ex) {
+    if (ex->ohead == NULL)
+        return;
+
+    if (ex->qtail == NULL)
+        ex->qhead = ex->ohead;
+    else
+        ex->qtail->next = ex->ohead;
+    ex->qtail = ex->otail;
+    ex->qlen += ex->olen;
+    ex->ohead = NULL;
+    ex->otail = NULL;
+    ex->olen = 0;
+}
+
+// Unmaps and closes the spill file of an executor class, if any. Tasks
+// still in the file are lost; tasks held back behind it join the queue.
+//
+// PARAMS:
+// ex - the executor class to close the file of
+static void spill_close(struct exec_t *ex) {
+    if (ex->smap != NULL) {
+        munmap(ex->smap, ex->scap);
+        close(ex->sfd);
+        ex->smap = NULL;
+        ex->sfd = -1;
+        ex->slen = 0;
+        spill_flush(ex);
+    }
+}
+
+// Runs fn(ctx, i) for every i below n on the given thread pool and waits
+// for all of them. The calling thread takes indices too, so the loop
+// completes even when no thread of the pool is free, or when called from
+// a task of the pool.
+//
+// PARAMS:
+// th  - the thread pool to run on
+// n   - number of indices
+// fn  - body of the loop
+// ctx - argument for the body
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+static _Bool par_run(prethd_t *th, size_t n, void (*fn)(void *, size_t),
+        void *ctx) {
+    if (n == 0)
+        return true;
+
+    struct par_t *par = malloc(sizeof *par);
+    if (par == NULL)
+        return false;
+    par->fn = fn;
+    par->ctx = ctx;
+    par->n = n;
+    par->next = 0;
+    par->done = 0;
+    par->refs = 1;
+    pthread_mutex_init(&par->mut, NULL);
+    pthread_cond_init(&par->cond, NULL);
+
+    struct worker_t *w = self_get(th);
+    size_t c = (w == NULL) ? 0 : (size_t)(w->exec - th->execs);
+    size_t helpers = (!th->tasks) ? 0 : (n - 1 < th->len) ? n - 1 : th->len;
+    for (size_t i = 0; i < helpers; i++) {
+        __atomic_add_fetch(&par->refs, 1, __ATOMIC_RELAXED);
+        if (!task_submit(th, c, par_help, par)) {
+            __atomic_sub_fetch(&par->refs, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    par_loop(par);
+    pthread_mutex_lock(&par->mut);
+    while (__atomic_load_n(&par->done, __ATOMIC_ACQUIRE) < n)
+        pthread_cond_wait(&par->cond, &par->mut);
+    pthread_mutex_unlock(&par->mut);
+    par_put(par);
+    return true;
+}
+
+// Helper task queued by par_run().
+//
+// PARAMS:
+// arg - the loop to help with
+//
+// RETURN:
+// NULL.
+static void *par_help(void *arg) {
+    par_loop(arg);
+    par_put(arg);
+    return NULL;
+}
+
+// Takes and runs indices of a parallel loop until none is left.
+//
+// PARAMS:
+// par - the loop to run
+static void par_loop(struct par_t *par) {
+    size_t i;
+    while ((i = __atomic_fetch_add(&par->next, 1, __ATOMIC_RELAXED)) <
+            par->n) {
+        par->fn(par->ctx, i);
+        if (__atomic_add_fetch(&par->done, 1, __ATOMIC_ACQ_REL) == par->n) {
+            pthread_mutex_lock(&par->mut);
+            pthread_cond_signal(&par->cond);
+            pthread_mutex_unlock(&par->mut);
+        }
+    }
+}
+
+// Drops a reference to a parallel loop, freeing it with the last one.
+//
+// PARAMS:
+// par - the loop to release
+static void par_put(struct par_t *par) {
+    if (__atomic_sub_fetch(&par->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&par->mut);
+        pthread_cond_destroy(&par->cond);
+        free(par);
+    }
+}
+
+// Counts one chunk of the items into the chunk's own table.
+//
+// PARAMS:
+// ctx - the histogram arguments
+// i   - the chunk index
+static void hist_chunk(void *ctx, size_t i) {
+    struct agg_t *agg = ctx;
+    size_t *tab = agg->counts + i * agg->nbins;
+    size_t lo = agg->n / agg->k * i + ((i < agg->n % agg->k) ? i :
+        agg->n % agg->k);
+    size_t hi = lo + agg->n / agg->k + ((i < agg->n % agg->k) ? 1 : 0);
+    for (size_t j = lo; j < hi; j++) {
+        size_t b = agg->bin(agg->data + j * agg->size, agg->ctx);
+        if (b < agg->nbins)
+            tab[b]++;
+    }
+}
+
+// Adds the table of one chunk into another at the current merge level.
+//
+// PARAMS:
+// ctx - the histogram arguments
+// i   - the pair index at the merge level
+static void hist_merge(void *ctx, size_t i) {
+    struct agg_t *agg = ctx;
+    size_t dst = i * 2 * agg->stride, src = dst + agg->stride;
+    if (src >= agg->k)
+        return;
+    size_t *d = agg->counts + dst * agg->nbins;
+    const size_t *s = agg->counts + src * agg->nbins;
+    for (size_t b = 0; b < agg->nbins; b++)
+        d[b] += s[b];
+}
+
+// Filters or partitions items by a predicate: counts the matches of each
+// chunk, turns the counts into output offsets and copies each chunk's
+// items to its offsets.
+//
+// PARAMS:
+// th   - the thread pool to run on
+// data - the items
+// n    - number of items
+// size - size of each item
+// pred - the predicate
+// ctx  - argument for pred
+// out  - receives the items
+// len  - receives the number of items matching pred
+// rest - 1 (true) to copy the items not matching pred after the others
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+static _Bool part_run(prethd_t *th, const void *data, size_t n, size_t size,
+        _Bool (*pred)(const void *item, void *ctx), void *ctx, void *out,
+        size_t *len, _Bool rest) {
+    if (th == NULL || ((data == NULL || out == NULL) && n > 0) ||
+            size == 0 || pred == NULL || len == NULL)
+        return false;
+
+    struct agg_t agg;
+    agg.data = data;
+    agg.n = n;
+    agg.size = size;
+    agg.pred = pred;
+    agg.ctx = ctx;
+    agg.out = out;
+    agg.rest = rest;
+    agg.k = (n < th->len + 1) ? ((n == 0) ? 1 : n) : th->len + 1;
+    agg.counts = malloc(agg.k * (sizeof *agg.counts));
+    if (agg.counts == NULL)
+        return false;
+
+    _Bool ret = par_run(th, agg.k, part_count, &agg);
+    if (ret) {
+        agg.kept = 0;
+        for (size_t i = 0; i < agg.k; i++) {
+            size_t c = agg.counts[i];
+            agg.counts[i] = agg.kept;
+            agg.kept += c;
+        }
+        ret = par_run(th, agg.k, part_scatter, &agg);
+    }
+    if (ret)
+        *len = agg.kept;
+    free(agg.counts);
+    return ret;
+}
+
+// Counts the items of one chunk matching the predicate.
+//
+// PARAMS:
+// ctx - the filter arguments
+// i   - the chunk index
+static void part_count(void *ctx, size_t i) {
+    struct agg_t *agg = ctx;
+    size_t lo = agg->n / agg->k * i + ((i < agg->n % agg->k) ? i :
+        agg->n % agg->k);
+    size_t hi = lo + agg->n / agg->k + ((i < agg->n % agg->k) ? 1 : 0);
+    size_t c = 0;
+    for (size_t j = lo; j < hi; j++)
+        c += agg->pred(agg->data + j * agg->size, agg->ctx) ? 1 : 0;
+    agg->counts[i] = c;
+}
+
+// Copies the items of one chunk to the chunk's output offsets. The items
+// not matching the predicate before the chunk number its start minus the
+// matching ones.
+//
+// PARAMS:
+// ctx - the filter arguments
+// i   - the chunk index
+static void part_scatter(void *ctx, size_t i) {
+    struct agg_t *agg = ctx;
+    size_t lo = agg->n / agg->k * i + ((i < agg->n % agg->k) ? i :
+        agg->n % agg->k);
+    size_t hi = lo + agg->n / agg->k + ((i < agg->n % agg->k) ? 1 : 0);
+    unsigned char *in = agg->out + agg->counts[i] * agg->size;
+    unsigned char *ex = agg->out + (agg->kept + lo - agg->counts[i]) *
+        agg->size;
+    for (size_t j = lo; j < hi; j++) {
+        const unsigned char *item = agg->data + j * agg->size;
+        if (agg->pred(item, agg->ctx)) {
+            memcpy(in, item, agg->size);
+            in += agg->size;
+        } else if (agg->rest) {
+            memcpy(ex, item, agg->size);
+            ex += agg->size;
+        }
+    }
+}
+
+// Expands one chunk of the frontier list top-down: claims the unvisited
+// out-neighbours of its vertices and collects them in the chunk's buffer.
+//
+// PARAMS:
+// ctx - the search state
+// i   - the chunk index
+static void bfs_down(void *ctx, size_t i) {
+    struct bfs_t *bfs = ctx;
+    struct bfs_buf_t *buf = bfs->bufs + i;
+    size_t lo = bfs->flen / bfs->k * i + ((i < bfs->flen % bfs->k) ? i :
+        bfs->flen % bfs->k);
+    size_t hi = lo + bfs->flen / bfs->k + ((i < bfs->flen % bfs->k) ? 1 : 0);
+    buf->len = 0;
+    buf->edges = 0;
+    for (size_t j = lo; j < hi; j++) {
+        size_t u = bfs->front[j];
+        for (size_t e = bfs->offs[u]; e < bfs->offs[u + 1]; e++) {
+            size_t v = bfs->adj[e], unseen = SIZE_MAX;
+            if (__atomic_load_n(bfs->dist + v, __ATOMIC_RELAXED) != SIZE_MAX ||
+                    !__atomic_compare_exchange_n(bfs->dist + v, &unseen,
+                    bfs->level + 1, false, __ATOMIC_RELAXED,
+                    __ATOMIC_RELAXED))
+                continue;
+            if (buf->len == buf->cap) {
+                size_t cap = (buf->cap == 0) ? 64 : buf->cap * 2;
+                size_t *grown = realloc(buf->v, cap * (sizeof *grown));
+                if (grown == NULL) {
+                    __atomic_store_n(&bfs->err, true, __ATOMIC_RELAXED);
+                    return;
+                }
+                buf->v = grown;
+                buf->cap = cap;
+            }
+            buf->v[buf->len++] = v;
+            buf->edges += bfs->offs[v + 1] - bfs->offs[v];
+        }
+    }
+}
+
+// Expands one chunk of the vertices bottom-up: each unvisited vertex looks
+// for an in-neighbour in the frontier bitmap. The chunk owns whole words
+// of the next bitmap, so it sets their bits without atomics.
+//
+// PARAMS:
+// ctx - the search state
+// i   - the chunk index
+static void bfs_up(void *ctx, size_t i) {
+    struct bfs_t *bfs = ctx;
+    struct bfs_buf_t *buf = bfs->bufs + i;
+    size_t lo = bfs->nw / bfs->k * i + ((i < bfs->nw % bfs->k) ? i :
+        bfs->nw % bfs->k);
+    size_t hi = lo + bfs->nw / bfs->k + ((i < bfs->nw % bfs->k) ? 1 : 0);
+    buf->len = 0;
+    buf->edges = 0;
+    for (size_t w = lo; w < hi; w++) {
+        uint64_t word = 0;
+        size_t end = (w * 64 + 64 < bfs->nv) ? w * 64 + 64 : bfs->nv;
+        for (size_t v = w * 64; v < end; v++) {
+            if (bfs->dist[v] != SIZE_MAX)
+                continue;
+            for (size_t e = bfs->roffs[v]; e < bfs->roffs[v + 1]; e++) {
+                size_t u = bfs->radj[e];
+                if (bfs->bits[u / 64] & ((uint64_t)1 << (u % 64))) {
+                    bfs->dist[v] = bfs->level + 1;
+                    word |= (uint64_t)1 << (v % 64);
+                    buf->len++;
+                    buf->edges += bfs->offs[v + 1] - bfs->offs[v];
+                    break;
+                }
+            }
+        }
+        bfs->nbits[w] = word;
+    }
+}
+
+// Copies the vertices one chunk found top-down into the next frontier
+// list, at the chunk's offset.
+//
+// PARAMS:
+// ctx - the search state
+// i   - the chunk index
+static void bfs_gather(void *ctx, size_t i) {
+    struct bfs_t *bfs = ctx;
+    size_t next = (i + 1 < bfs->k) ? bfs->bufs[i + 1].len : bfs->flen;
+    if (next > bfs->bufs[i].len)
+        memcpy(bfs->nfront + bfs->bufs[i].len, bfs->bufs[i].v,
+            (next - bfs->bufs[i].len) * (sizeof *bfs->nfront));
+}
+
+// Sets the bits of one chunk of the frontier list in the frontier bitmap.
+//
+// PARAMS:
+// ctx - the search state
+// i   - the chunk index
+static void bfs_pack(void *ctx, size_t i) {
+    struct bfs_t *bfs = ctx;
+    size_t lo = bfs->flen / bfs->k * i + ((i < bfs->flen % bfs->k) ? i :
+        bfs->flen % bfs->k);
+    size_t hi = lo + bfs->flen / bfs->k + ((i < bfs->flen % bfs->k) ? 1 : 0);
+    for (size_t j = lo; j < hi; j++) {
+        size_t v = bfs->front[j];
+        __atomic_fetch_or(bfs->bits + v / 64, (uint64_t)1 << (v % 64),
+            __ATOMIC_RELAXED);
+    }
+}
+
+// Lists the vertices of one chunk of the next frontier bitmap in the next
+// frontier list, at the chunk's offset.
+//
+// PARAMS:
+// ctx - the search state
+// i   - the chunk index
+static void bfs_unpack(void *ctx, size_t i) {
+    struct bfs_t *bfs = ctx;
+    size_t lo = bfs->nw / bfs->k * i + ((i < bfs->nw % bfs->k) ? i :
+        bfs->nw % bfs->k);
+    size_t hi = lo + bfs->nw / bfs->k + ((i < bfs->nw % bfs->k) ? 1 : 0);
+    size_t *out = bfs->nfront + bfs->bufs[i].len;
+    for (size_t w = lo; w < hi; w++)
+        for (uint64_t word = bfs->nbits[w]; word != 0; word &= word - 1)
+            *out++ = w * 64 + (size_t)__builtin_ctzll(word);
+}
+
+// Groups one chunk of the items into the chunk's own hash table.
+//
+// PARAMS:
+// ctx - the group-by arguments
+// i   - the chunk index
+static void group_chunk(void *ctx, size_t i) {
+    struct agg_t *agg = ctx;
+    const uint64_t *keys = (const uint64_t *)agg->data;
+    size_t lo = agg->n / agg->k * i + ((i < agg->n % agg->k) ? i :
+        agg->n % agg->k);
+    size_t hi = lo + agg->n / agg->k + ((i < agg->n % agg->k) ? 1 : 0);
+    prethd_group_t g;
+    g.count = 1;
+    for (size_t j = lo; j < hi; j++) {
+        g.key = keys[j];
+        g.sum = agg->vals[j];
+        if (!group_add(agg->tabs + i, &g)) {
+            __atomic_store_n(&agg->err, true, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+// Merges the hash table of one chunk into another at the current merge
+// level.
+//
+// PARAMS:
+// ctx - the group-by arguments
+// i   - the pair index at the merge level
+static void group_merge(void *ctx, size_t i) {
+    struct agg_t *agg = ctx;
+    size_t dst = i * 2 * agg->stride, src = dst + agg->stride;
+    if (src >= agg->k)
+        return;
+    struct group_tab_t *s = agg->tabs + src;
+    for (size_t j = 0; j < s->cap; j++) {
+        if (s->used[j] && !group_add(agg->tabs + dst, s->slots + j)) {
+            __atomic_store_n(&agg->err, true, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+// Adds a partial group into a hash table, growing the table once it is
+// half full.
+//
+// PARAMS:
+// tab - the table to add to
+// g   - the partial group to add
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+static _Bool group_add(struct group_tab_t *tab, const prethd_group_t *g) {
+    if (2 * (tab->len + 1) > tab->cap) {
+        struct group_tab_t big;
+        big.cap = (tab->cap == 0) ? 64 : tab->cap * 2;
+        big.len = 0;
+        big.slots = malloc(big.cap * (sizeof *big.slots));
+        big.used = calloc(big.cap, sizeof *big.used);
+        if (big.slots == NULL || big.used == NULL) {
+            group_free(&big);
+            return false;
+        }
+        for (size_t i = 0; i < tab->cap; i++)
+            if (tab->used[i])
+                group_add(&big, tab->slots + i);
+        group_free(tab);
+        *tab = big;
+    }
+
+    uint64_t h = g->key;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    size_t i = (size_t)h & (tab->cap - 1);
+    while (tab->used[i] && tab->slots[i].key != g->key)
+        i = (i + 1) & (tab->cap - 1);
+    if (tab->used[i]) {
+        tab->slots[i].count += g->count;
+        tab->slots[i].sum += g->sum;
+    } else {
+        tab->used[i] = true;
+        tab->slots[i] = *g;
+        tab->len++;
+    }
+    return true;
+}
+
+// Frees the slots of a group-by hash table.
+//
+// PARAMS:
+// tab - the table to free
+static void group_free(struct group_tab_t *tab) {
+    free(tab->slots);
+    free(tab->used);
+    tab->slots = NULL;
+    tab->used = NULL;
+    tab->cap = 0;
+    tab->len = 0;
+}
+
+// Orders groups by key, for qsort().
+static int group_cmp(const void *a, const void *b) {
+    const prethd_group_t *x = a, *y = b;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+// Generates one block of a random stream: 10 Philox4x32 rounds over the
+// block counter and the stream number.
+//
+// PARAMS:
+// r   - the random stream
+// ctr - the block counter
+// out - receives the 4 random words
+static void rng_block(const prethd_rng_t *r, uint64_t ctr, uint32_t *out) {
+    uint32_t c0 = (uint32_t)ctr, c1 = (uint32_t)(ctr >> 32);
+    uint32_t c2 = r->stream[0], c3 = r->stream[1];
+    uint32_t k0 = r->key[0], k1 = r->key[1];
+    for (int i = 0; i < 10; i++) {
+        uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// Task queued by prethd_async(): runs the function unless the future was
+// cancelled first, then wakes the threads waiting on the future.
+//
+// PARAMS:
+// arg - the future
+//
+// RETURN:
+// NULL.
+static void *fut_run(void *arg) {
+    prethd_future_t *f = arg;
+    int state = FUT_PENDING;
+    if (__atomic_compare_exchange_n(&f->state, &state, FUT_RUNNING, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        struct worker_t *w = self_any();     // lent to another pool maybe
+        prethd_future_t *outer = (w == NULL) ? NULL : w->fut;
+        if (w != NULL)
+            w->fut = f;
+        f->ret = f->func(f->arg);
+        if (w != NULL)
+            w->fut = outer;
+        fut_finish(f, FUT_DONE);
+    }
+    prethd_future_free(f);
+    return NULL;
+}
+
+// Sets the final state of a future and wakes the threads waiting on it.
+//
+// PARAMS:
+// f     - the future
+// state - FUT_DONE or FUT_CANCELLED
+static void fut_finish(prethd_future_t *f, int state) {
+    pthread_mutex_lock(&f->mut);
+    __atomic_store_n(&f->state, state, __ATOMIC_RELEASE);
+    for (struct fut_link_t *l = f->waiters; l != NULL; l = l->next) {
+        pthread_mutex_lock(&l->w->mut);
+        pthread_cond_broadcast(&l->w->cond);
+        pthread_mutex_unlock(&l->w->mut);
+    }
+    pthread_mutex_unlock(&f->mut);
+}
+
+// Waits until all, or any, of the futures have finished. The calling
+// thread registers with every future, then checks them under its own
+// mutex, which fut_finish() takes to wake it, so no wake-up is lost. A
+// pool thread runs queued tasks of its class instead of sleeping, so that
+// waiting from inside tasks cannot use up the pool.
+//
+// PARAMS:
+// futs - the futures to wait for
+// n    - number of futures
+// any  - 1 (true) to wait for the first task to return, 0 (false) for all
+//        to finish
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+static _Bool fut_wait(prethd_future_t **futs, size_t n, _Bool any) {
+    for (size_t i = 0; i < n; i++)
+        if (futs[i] == NULL)
+            return false;
+    if (fut_ready(futs, n, any))
+        return true;
+
+    struct fut_link_t *links = malloc(n * (sizeof *links));
+    if (links == NULL)
+        return false;
+    struct fut_wait_t wt;
+    pthread_mutex_init(&wt.mut, NULL);
+    pthread_cond_init(&wt.cond, NULL);
+    for (size_t i = 0; i < n; i++) {
+        links[i].w = &wt;
+        pthread_mutex_lock(&futs[i]->mut);
+        links[i].next = futs[i]->waiters;
+        futs[i]->waiters = links + i;
+        pthread_mutex_unlock(&futs[i]->mut);
+    }
+
+    struct worker_t *w = self_get(futs[0]->pool);
+    while (!fut_ready(futs, n, any)) {
+        if (w != NULL && sem_trywait(&w->exec->qsem) == 0) {
+            if (task_next(w->pool, w))
+                continue;
+            sem_post(&w->exec->qsem);       // not ours, e.g. a stop token
+        }
+        pthread_mutex_lock(&wt.mut);
+        if (!fut_ready(futs, n, any))
+            pthread_cond_wait(&wt.cond, &wt.mut);
+        pthread_mutex_unlock(&wt.mut);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        pthread_mutex_lock(&futs[i]->mut);
+        struct fut_link_t **l = &futs[i]->waiters;
+        while (*l != links + i)
+            l = &(*l)->next;
+        *l = links[i].next;
+        pthread_mutex_unlock(&futs[i]->mut);
+    }
+    pthread_mutex_destroy(&wt.mut);
+    pthread_cond_destroy(&wt.cond);
+    free(links);
+    return true;
+}
+
+// Checks whether all, or any, of the futures have finished.
+//
+// PARAMS:
+// futs - the futures to check
+// n    - number of futures
+// any  - 1 (true) if one returned task is enough, 0 (false) for all to
+//        finish
+//
+// RETURN:
+// 1 (true) if the wait is over, 0 (false) otherwise.
+static _Bool fut_ready(prethd_future_t **futs, size_t n, _Bool any) {
+    size_t fin = 0;
+    for (size_t i = 0; i < n; i++) {
+        int state = __atomic_load_n(&futs[i]->state, __ATOMIC_ACQUIRE);
+        if (any && state == FUT_DONE)
+            return true;
+        if (state == FUT_DONE || state == FUT_CANCELLED)
+            fin++;
+    }
+    return fin == n;
+}
+
+// Task queued by prethd_submit_to() for coalesced tasks: runs them in
+// submission order.
+//
+// PARAMS:
+// arg - the batch
+//
+// RETURN:
+// NULL.
+static void *batch_run(void *arg) {
+    struct batch_t *b = arg;
+    for (size_t i = 0; i < b->len; i++)
+        b->tasks[i].func(b->tasks[i].arg);
+    return NULL;
+}
+
+// Runs a bulkhead task if it holds or can take a permit, otherwise parks
+// it on the semaphore. Parking and taking a permit for a parked task both
+// happen under the semaphore's mutex, and a parked task re-checks the
+// semaphore, so a permit released meanwhile is never missed.
+//
+// PARAMS:
+// arg - the bulkhead task
+//
+// RETURN:
+// NULL.
+static void *bulk_run(void *arg) {
+    struct bulk_t *b = arg;
+    prethd_t *th = b->pool;
+    struct psem_t *ps = th->sems + b->s;
+
+    if (!b->held && sem_trywait(&ps->sem) != 0) {
+        pthread_mutex_lock(&ps->bmut);
+        if (ps->ptail == NULL)
+            ps->phead = b;
+        else
+            ps->ptail->next = b;
+        ps->ptail = b;
+        __atomic_add_fetch(&ps->plen, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ps->bmut);
+        bulk_drain(th, ps);
+        return NULL;
+    }
+
+    size_t s = b->s;
+    b->func(b->arg);
+    free(b);
+    prethd_sem_release(th, s);
+    return NULL;
+}
+
+// Hands free permits of a semaphore to its parked bulkhead tasks and
+// queues them again. A task that cannot be queued because the pool is
+// being drained runs on the calling thread instead, and is dropped if the
+// pool is being cancelled.
+//
+// PARAMS:
+// th - the thread pool the semaphore belongs to
+// ps - the semaphore to drain
+static void bulk_drain(prethd_t *th, struct psem_t *ps) {
+    for (;;) {
+        pthread_mutex_lock(&ps->bmut);
+        struct bulk_t *b = ps->phead;
+        if (b == NULL || sem_trywait(&ps->sem) != 0) {
+            pthread_mutex_unlock(&ps->bmut);
+            return;
+        }
+        ps->phead = b->next;
+        if (ps->phead == NULL)
+            ps->ptail = NULL;
+        __atomic_sub_fetch(&ps->plen, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ps->bmut);
+
+        b->held = true;
+        b->next = NULL;
+        if (task_submit(th, b->c, bulk_run, b))
+            continue;
+        if (__atomic_load_n(&th->cancel, __ATOMIC_ACQUIRE)) {
+            size_t s = b->s;
+            free(b);
+            prethd_sem_release(th, s);
+        } else {
+            bulk_run(b);
+        }
+    }
+}
+
+// Pushes a task into the signal ring. Never blocks on another producer,
+// so a signal handler interrupting a push on the same thread still gets
+// its own slot.
+//
+// PARAMS:
+// th   - the thread pool to push to
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) if there is no ring or it is full.
+static _Bool ring_push(prethd_t *th, void *(*func)(void *), void *arg) {
+    struct sig_slot_t *ring = __atomic_load_n(&th->ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL)
+        return false;
+
+    struct sig_slot_t *slot;
+    size_t pos = __atomic_load_n(&th->rtail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = ring + (pos & th->rmask);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&th->rtail, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+            return false;       // full
+        } else {
+            pos = __atomic_load_n(&th->rtail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->func = func;
+    slot->arg = arg;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Pops a task from the signal ring. A head slot that a producer has
+// reserved but not yet filled is waited for: its token may already have
+// been taken for a later slot, which would otherwise be left without one.
+// Slots a fork child inherited half filled are skipped.
+//
+// PARAMS:
+// th - the thread pool to pop from
+// t  - receives the task
+//
+// RETURN:
+// 1 (true) if a task was popped, 0 (false) if the ring is empty.
+static _Bool ring_pop(prethd_t *th, struct task_t *t) {
+    struct sig_slot_t *ring = __atomic_load_n(&th->ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL)
+        return false;
+
+    struct sig_slot_t *slot;
+    size_t pos = __atomic_load_n(&th->rhead, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = ring + (pos & th->rmask);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos + 1) {
+            if (__atomic_compare_exchange_n(&th->rhead, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+            if (__atomic_load_n(&th->rtail, __ATOMIC_ACQUIRE) == pos)
+                return false;   // empty
+            sched_yield();      // reserved, the producer is still filling it
+            pos = __atomic_load_n(&th->rhead, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&th->rhead, __ATOMIC_RELAXED);
+        }
+    }
+    t->func = slot->func;
+    t->arg = slot->arg;
+    __atomic_store_n(&slot->seq, pos + th->rmask + 1, __ATOMIC_RELEASE);
+    return t->func != NULL || ring_pop(th, t);  // skip a hole of fork_child()
+}
+
+// Adds the pool to the fork registry, installing the atfork handlers on
+// first use.
+//
+// PARAMS:
+// th - the thread pool to add
+static void reg_add(prethd_t *th) {
+    pthread_once(&reg_once, reg_atfork);
+    pthread_mutex_lock(&reg_mut);
+    th->next = reg_head;
+    reg_head = th;
+    pthread_mutex_unlock(&reg_mut);
+}
+
+// Removes the pool from the fork registry.
+//
+// PARAMS:
+// th - the thread pool to remove
+static void reg_del(prethd_t *th) {
+    pthread_mutex_lock(&reg_mut);
+    for (prethd_t **p = &reg_head; *p != NULL; p = &(*p)->next) {
+        if (*p == th) {
+            *p = th->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reg_mut);
+}
+
+// Installs the atfork handlers. Called once through pthread_once().
+static void reg_atfork(void) {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+// Quiesces every pool before fork() by taking all of its internal
+// mutexes, so that no thread is inside one of the pool's own critical
+// sections when the address space is copied. The mutexes of prethd_lock()
+// are left to their users: taking them here would impose a lock order on
+// user code, and stall the fork behind any task holding one while it
+// blocks. Spilled tasks stay on disk with the parent, as the child cannot
+// share the spill file.
+static void fork_prepare(void) {
+    pthread_mutex_lock(&def_mut);
+    pthread_mutex_lock(&reg_mut);
+    for (prethd_t *th = reg_head; th != NULL; th = th->next) {
+        for (size_t i = 0; i < th->slen; i++)
+            pthread_mutex_lock(&th->sems[i].bmut);
+        pthread_mutex_lock(&th->tmut);
+        pthread_mutex_lock(&th->lmut);
+        pthread_mutex_lock(&th->xmut);
+        for (size_t i = 0; i < th->elen; i++)
+            pthread_mutex_lock(&th->execs[i].qmut);
+        for (size_t i = 0; i < th->len; i++) {
+            pthread_mutex_lock(&th->workers[i].dmut);
+            pthread_mutex_lock(&th->workers[i].amut);
+        }
+    }
+}
+
+// Releases the mutexes taken by fork_prepare() in the parent.
+static void fork_parent(void) {
+    for (prethd_t *th = reg_head; th != NULL; th = th->next) {
+        for (size_t i = th->len; i > 0; i--) {
+            pthread_mutex_unlock(&th->workers[i - 1].amut);
+            pthread_mutex_unlock(&th->workers[i - 1].dmut);
+        }
+        for (size_t i = th->elen; i > 0; i--)
+            pthread_mutex_unlock(&th->execs[i - 1].qmut);
+        pthread_mutex_unlock(&th->xmut);
+        pthread_mutex_unlock(&th->lmut);
+        pthread_mutex_unlock(&th->tmut);
+        for (size_t i = th->slen; i > 0; i--)
+            pthread_mutex_unlock(&th->sems[i - 1].bmut);
+    }
+    pthread_mutex_unlock(&reg_mut);
+    pthread_mutex_unlock(&def_mut);
+}
+
+// Reinitialises the sync objects of every pool in the child, the mutexes
+// of prethd_lock() included, which may have been held by threads that
+// stayed behind. Only the forking thread exists in the child, so the
+// pools are left without threads until prethd_respawn() is called. Spill
+// files and spawned subtasks stay with the parent.
+static void fork_child(void) {
+    pthread_mutex_init(&def_mut, NULL);
+    pthread_mutex_init(&reg_mut, NULL);
+    share_idle = 0;
+    for (prethd_t *th = reg_head; th != NULL; th = th->next) {
+        for (size_t i = 0; i < th->mlen; i++)
+            pthread_mutex_init(th->muts + i, NULL);
+        for (size_t i = 0; i < th->clen; i++)
+            pthread_cond_init(th->conds + i, NULL);
+        for (size_t i = 0; i < th->slen; i++) {
+            int val = 0;
+            sem_getvalue(&th->sems[i].sem, &val);
+            sem_init(&th->sems[i].sem, 0, (val > 0) ? (unsigned)val : 0);
+            pthread_mutex_init(&th->sems[i].bmut, NULL);
+        }
+        pthread_mutex_init(&th->tmut, NULL);
+        pthread_mutex_init(&th->lmut, NULL);
+        pthread_mutex_init(&th->xmut, NULL);
+        pthread_cond_init(&th->xcond, NULL);
+        size_t ring = __atomic_load_n(&th->rtail, __ATOMIC_RELAXED) -
+            __atomic_load_n(&th->rhead, __ATOMIC_RELAXED);
+        for (size_t p = th->rhead; ring > 0 && p != th->rtail; p++) {
+            struct sig_slot_t *slot = th->ring + (p & th->rmask);
+            if (slot->seq != p + 1) {   // its producer stayed behind
+                slot->func = NULL;
+                slot->seq = p + 1;
+            }
+        }
+        for (size_t i = 0; i < th->elen; i++) {
+            struct exec_t *ex = th->execs + i;
+            spill_close(ex);    // its tasks are the parent's
+            pthread_mutex_init(&ex->qmut, NULL);
+            sem_init(&ex->qsem, 0, ex->qlen + ((i == 0) ? ring : 0));
+            ex->idle = 0;
+        }
+        for (size_t i = 0; i < th->len; i++) {
+            struct worker_t *w = th->workers + i;
+            pthread_mutex_init(&w->dmut, NULL);
+            pthread_mutex_init(&w->amut, NULL);
+            w->dtop = 0;        // spawned by threads gone with the parent
+            w->dbot = 0;
+            w->epoch = 0;
+            w->edepth = 0;
+        }
+        for (size_t i = 0; i < 3; i++)
+            th->eout[i] = 0;
+        th->lent = 0;           // borrowed by threads gone with the parent
+        th->forked = th->run > 0;
+        th->run = 0;
+        th->live = 0;           // the task loop threads stayed behind too
+        th->tasks = false;
+        th->stop = false;
+        th->cancel = false;
+        th->abort = false;
     }
 }
@@ -6,12 +6,83 @@
 #ifndef PRETHD_H
 #define PRETHD_H
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
 
 // Represents pre-allocated threads.
 typedef struct pre_threads_t prethd_t;
 
+// Result of a task queued with prethd_async().
+typedef struct prethd_future_t prethd_future_t;
+
+// Ordered map safe for concurrent use, see prethd_skip_new().
+typedef struct prethd_skip_t prethd_skip_t;
+
+// Bounded producer and consumer queue, see prethd_bqueue_new().
+typedef struct prethd_bqueue_t prethd_bqueue_t;
+
+// Shutdown modes of prethd_shutdown().
+typedef enum {
+    PRETHD_DRAIN,           // run every queued task first
+    PRETHD_CANCEL,          // drop queued tasks
+    PRETHD_ABORT            // drop queued tasks, ask running tasks to return
+} prethd_mode_t;
+
+// Counter-based random stream, see prethd_rng_init().
+typedef struct {
+    uint32_t key[2];        // key, from the seed
+    uint32_t stream[2];     // stream number
+    uint64_t ctr;           // counter of the next block
+    uint32_t buf[4];        // current block
+    unsigned pos;           // next unused word of the current block
+} prethd_rng_t;
+
+// Callbacks of a per-thread resource, see prethd_resources().
+typedef struct {
+    void *(*create)(void *ctx);             // creates an instance
+    void (*destroy)(void *res, void *ctx);  // destroys an instance, or NULL
+    void *ctx;                              // argument for the callbacks
+} prethd_res_t;
+
+// Critical path of a traced task graph, see prethd_critical_path(). Times
+// are in seconds.
+typedef struct {
+    size_t tasks;           // number of traced tasks
+    double work;            // total running time, nested time excluded
+    double span;            // running time along the critical path
+    double wall;            // time from the first task start to the last end
+    double parallelism;     // parallelism achieved, work over wall
+    double ideal;           // parallelism possible, work over span
+    size_t *path;           // trace ids on the critical path, in order
+    size_t plen;            // number of tasks on the critical path
+    double *slack;          // slack of each task, by trace id minus one
+} prethd_cpath_t;
+
+// Group of prethd_parallel_groupby().
+typedef struct {
+    uint64_t key;           // key shared by the group
+    size_t count;           // number of items in the group
+    double sum;             // sum of the values in the group
+} prethd_group_t;
+
+// Time used by the tasks of one tag, see prethd_usage(). Times are in
+// seconds.
+typedef struct {
+    uint64_t tag;           // tag the tasks were queued with
+    size_t tasks;           // number of tasks run
+    double cpu;             // thread CPU time used
+    double wall;            // wall time taken
+} prethd_usage_t;
+
+// Frame of a task spawning subtasks, see prethd_frame().
+typedef struct {
+    prethd_t *pool;         // the pool running the task
+    size_t pending;         // subtasks spawned and not finished
+    pthread_mutex_t mut;    // mutex guarding pending
+    pthread_cond_t cond;    // signalled when the last subtask finishes
+} prethd_frame_t;
+
 // Allocate a new pool of threads.
 //
 // PARAMS:
@@ -23,6 +94,15 @@ typedef struct pre_threads_t prethd_t;
 // Allocated pool of threads, or NULL on error.
 prethd_t *prethd_new(size_t th, size_t mut, size_t cond);
 
+// Returns the process-wide default pool, creating and starting it on
+// first use. It has one thread per CPU the process may run on, so
+// libraries sharing it do not oversubscribe the machine, and it is joined
+// and freed at exit(). In a child process it is restarted on first use.
+//
+// RETURN:
+// The default pool, or NULL on error.
+prethd_t *prethd_default(void);
+
 // Starts all the threads in the given thread pool.
 //
 // PARAMS:
@@ -34,6 +114,452 @@ prethd_t *prethd_new(size_t th, size_t mut, size_t cond);
 // The number of threads started, 0 on error.
 size_t prethd_all(prethd_t *th, void *(*func)(void *), void *arg);
 
+// Starts all the threads in the given thread pool running its task loop.
+// Tasks are then handed to the threads with prethd_submit() and
+// prethd_submit_from_signal(), and run in submission order.
+//
+// PARAMS:
+// th - the thread pool to start
+//
+// RETURN:
+// The number of threads started, 0 on error.
+size_t prethd_start(prethd_t *th);
+
+// Pins the threads of the given thread pool to CPUs: thread i runs on
+// cpus[i % n]. Must be called before prethd_all() or prethd_start().
+//
+// PARAMS:
+// th   - the thread pool to pin
+// cpus - CPU of each thread, or NULL to let them run anywhere
+// n    - number of CPUs given
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_affinity(prethd_t *th, const int *cpus, size_t n);
+
+// Sets the stack of the threads of the given thread pool. Smaller stacks
+// let a process run many more threads, as each thread reserves its whole
+// stack of address space and commits the pages it touches. Must be called
+// before prethd_all() or prethd_start().
+//
+// PARAMS:
+// th    - the thread pool to configure
+// size  - stack size in bytes, at least PTHREAD_STACK_MIN, or 0 for the
+//         system default
+// guard - guard size in bytes below the stack, or SIZE_MAX for the system
+//         default
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_stack(prethd_t *th, size_t size, size_t guard);
+
+// Splits the threads of the given thread pool into executor classes, each
+// with its own task queue, e.g. one class for CPU bound tasks and one for
+// blocking I/O. Threads are assigned to the classes in order. Must be
+// called before prethd_start().
+//
+// PARAMS:
+// th    - the thread pool to split
+// names - name of each class
+// sizes - number of threads in each class, adding up to the pool size
+// n     - number of classes
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_classes(prethd_t *th, const char **names, const size_t *sizes,
+        size_t n);
+
+// Returns the number of executor classes in the thread pool.
+//
+// PARAMS:
+// th - the thread pool to retrieve the size
+//
+// RETURN:
+// The thread pool executor class size, or 0 on error.
+size_t prethd_class_size(prethd_t *th);
+
+// Returns the name of an executor class in the thread pool.
+//
+// PARAMS:
+// th - the thread pool to retrieve the name
+// c  - the executor class index
+//
+// RETURN:
+// The executor class name, or NULL on error.
+const char *prethd_class_name(prethd_t *th, size_t c);
+
+// Registers per-thread resources of the thread pool, such as file
+// descriptors or parser states. Each thread running the task loop creates
+// its own instance of a resource the first time it asks for it with
+// prethd_resource(), and destroys it when it exits. Must be called before
+// prethd_start().
+//
+// PARAMS:
+// th  - the thread pool to register the resources for
+// res - callbacks of each resource
+// n   - number of resources
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_resources(prethd_t *th, const prethd_res_t *res, size_t n);
+
+// Returns the calling thread's instance of a per-thread resource, creating
+// it on first use. Does not lock; only threads running the task loop of
+// the pool have instances.
+//
+// PARAMS:
+// th - the thread pool the resource is registered with
+// i  - the index of the resource
+//
+// RETURN:
+// The resource instance, or NULL on error.
+void *prethd_resource(prethd_t *th, size_t i);
+
+// Queues a task for the threads of a started pool. The task goes to the
+// first executor class.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_submit(prethd_t *th, void *(*func)(void *), void *arg);
+
+// Queues a task for the threads of an executor class in a started pool.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// c    - the executor class index
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_submit_to(prethd_t *th, size_t c, void *(*func)(void *),
+        void *arg);
+
+// Queues a task for the threads of an executor class in a started pool,
+// giving the task its own copy of the data. The function receives a
+// pointer to the copy, which is freed once the function returns. Only
+// tasks with a copy are written out in full when the queue spills to
+// disk; other tasks keep pointing at memory owned by the caller.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// c    - the executor class index
+// func - function to run
+// data - data to copy for the function
+// size - size of the data
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_submit_copy(prethd_t *th, size_t c, void *(*func)(void *),
+        const void *data, size_t size);
+
+// Queues a task for the threads of an executor class in a started pool,
+// tagged for CPU time accounting, see prethd_account(). Tasks queued
+// without a tag have tag 0.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// c    - the executor class index
+// tag  - the tag to account the task's time to
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_submit_tagged(prethd_t *th, size_t c, uint64_t tag,
+        void *(*func)(void *), void *arg);
+
+// Adds a disk overflow tier to the queue of an executor class. Once the
+// queue holds hiwat tasks, further tasks are appended to a memory mapped
+// file instead of being kept in memory, and the threads read them back as
+// the queue falls to half of hiwat. The file is used as a ring, so the
+// space of tasks read back is reused. Tasks are held in memory when the
+// file is full, so no task is ever rejected; they stay behind the spilled
+// tasks, which keeps the queue in submission order. The file is created
+// at path, which must not exist yet, and unlinked as soon as it is
+// mapped, so it never outlives the pool. Its disk space is given back
+// whenever it empties. A child of fork() inherits neither the file nor
+// the tasks in it, which stay with the parent.
+//
+// PARAMS:
+// th    - the thread pool to add the tier to
+// c     - the executor class index
+// path  - path of the spill file to create, not followed if a symlink
+// hiwat - queue length from which tasks spill
+// cap   - size of the spill file in bytes
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_spill(prethd_t *th, size_t c, const char *path, size_t hiwat,
+        size_t cap);
+
+// Returns the number of tasks of an executor class waiting in its spill
+// file.
+//
+// PARAMS:
+// th - the thread pool to retrieve the count
+// c  - the executor class index
+//
+// RETURN:
+// The number of spilled tasks, or 0 on error.
+size_t prethd_spilled(prethd_t *th, size_t c);
+
+// Turns coalescing of small tasks on or off for an executor class. While
+// on, a task queued with prethd_submit() or prethd_submit_to() while the
+// last task the same thread queued in the class is still waiting at the
+// tail of the queue joins that entry instead of taking its own, up to max
+// tasks per entry. One thread then runs them back to back, saving the
+// queueing and wake-up of all but the first. Nothing is held back, so
+// tasks never wait for a batch to fill. Traced tasks are not coalesced,
+// nor are the pool's own, e.g. those of prethd_async() or the parallel
+// algorithms.
+//
+// PARAMS:
+// th  - the thread pool to set
+// c   - the executor class index
+// max - most tasks per queue entry, 1 or 0 to turn coalescing off
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_coalesce(prethd_t *th, size_t c, size_t max);
+
+// Lets the given thread pool share its threads with the other pools that
+// do. Once a sharing pool has a task queued and none of its own threads
+// is free to take it, an idle thread of another sharing pool takes it, so
+// spare cores follow the load without more threads than cores. A lent
+// task runs as if on a thread outside its pool: prethd_spawn() runs
+// subtasks at once and prethd_resource() returns NULL, while
+// prethd_cancelled() and prethd_usage() count it with its pool. Shutting
+// the pool down waits for its lent tasks too. Must be called before
+// prethd_start().
+//
+// PARAMS:
+// th - the thread pool to set
+// on - 1 (true) to share, 0 (false) to stop
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_share(prethd_t *th, _Bool on);
+
+// Turns tracing of the task graph on or off. While on, every task queued
+// with prethd_submit() and its variants, prethd_spawn() or
+// prethd_submit_from_signal() is given a trace id and its timings are
+// recorded. A task queued from inside a traced task depends on
+// the part of it that ran before; further dependencies are added with
+// prethd_trace_edge(). Turning tracing on discards the previous trace.
+//
+// PARAMS:
+// th - the thread pool to trace
+// on - 1 (true) to trace, 0 (false) to stop
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_trace(prethd_t *th, _Bool on);
+
+// Returns the trace id of the task running on the calling thread.
+//
+// PARAMS:
+// th - the thread pool running the task
+//
+// RETURN:
+// The trace id, or 0 if the calling thread is not running a traced task
+// of the pool.
+size_t prethd_trace_id(prethd_t *th);
+
+// Records that a traced task cannot start before another has returned.
+// Dependencies must point forward, to a task traced later.
+//
+// PARAMS:
+// th   - the thread pool running the tasks
+// from - trace id of the task depended on
+// to   - trace id of the dependent task
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_trace_edge(prethd_t *th, size_t from, size_t to);
+
+// Computes the critical path of the traced task graph: the chain of
+// dependent tasks with the longest total running time. Tasks off the
+// critical path have slack, the time they could be delayed without making
+// the graph take longer. Comparing the parallelism achieved with the
+// ideal one, work over span, tells whether more threads can help: once
+// they are close, the graph is bound by its span. The work of a task
+// leaves out the time it spent running nested tasks or in prethd_sync(),
+// so that nested work is counted once. Should be called once the traced
+// tasks have returned.
+//
+// PARAMS:
+// th - the thread pool traced
+// cp - receives the critical path, freed with prethd_cpath_free()
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error or if nothing was traced.
+_Bool prethd_critical_path(prethd_t *th, prethd_cpath_t *cp);
+
+// Frees the arrays of a critical path computed by prethd_critical_path().
+//
+// PARAMS:
+// cp - the critical path to free
+void prethd_cpath_free(prethd_cpath_t *cp);
+
+// Turns CPU time accounting on or off. While on, the thread CPU time and
+// the wall time of every task taken off a queue are added up by the tag
+// the task was queued with, see prethd_submit_tagged(), in tables kept by
+// each thread and read with prethd_usage(). Subtasks of prethd_spawn()
+// are counted under the tag of the task that spawned them, and tasks of
+// prethd_submit_from_signal() under tag 0. The time of tasks run inside
+// another task while it waits is counted for them only.
+//
+// PARAMS:
+// th - the thread pool to account
+// on - 1 (true) to account, 0 (false) to stop
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_account(prethd_t *th, _Bool on);
+
+// Returns the time used by the tasks of each tag so far, added up over the
+// threads of the pool while they keep running. A tag whose wall time is
+// well above its CPU time spends its tasks blocked.
+//
+// PARAMS:
+// th  - the thread pool to read
+// out - receives the totals sorted by tag, freed with free()
+//
+// RETURN:
+// The number of tags, or 0 on error or if no task was accounted.
+size_t prethd_usage(prethd_t *th, prethd_usage_t **out);
+
+// Sets the seed of the per-thread random streams of the thread pool. The
+// stream of each thread is derived from the seed and the thread index, so
+// the same seed always gives the same streams. Applies from the next
+// prethd_start().
+//
+// PARAMS:
+// th   - the thread pool to seed
+// seed - the seed
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_seed(prethd_t *th, uint64_t seed);
+
+// Returns the random stream of the calling thread. Only the calling
+// thread may use it, so no locking is needed.
+//
+// PARAMS:
+// th - the thread pool the thread belongs to
+//
+// RETURN:
+// The random stream, or NULL if the calling thread is not running the
+// task loop of the pool.
+prethd_rng_t *prethd_rng(prethd_t *th);
+
+// Initialises a counter-based (Philox4x32-10) random stream. Streams with
+// the same seed but different stream numbers are independent; seeding a
+// stream by task rather than by thread makes the numbers a task gets
+// independent of the schedule.
+//
+// PARAMS:
+// r      - the random stream to initialise
+// seed   - the seed
+// stream - the stream number
+void prethd_rng_init(prethd_rng_t *r, uint64_t seed, uint64_t stream);
+
+// Returns the next 32 random bits of a random stream.
+//
+// PARAMS:
+// r - the random stream
+//
+// RETURN:
+// The random bits.
+uint32_t prethd_rng_u32(prethd_rng_t *r);
+
+// Returns the next 64 random bits of a random stream.
+//
+// PARAMS:
+// r - the random stream
+//
+// RETURN:
+// The random bits.
+uint64_t prethd_rng_u64(prethd_rng_t *r);
+
+// Returns the next random number of a random stream, uniform in [0, 1).
+//
+// PARAMS:
+// r - the random stream
+//
+// RETURN:
+// The random number.
+double prethd_rng_double(prethd_rng_t *r);
+
+// Fills an array with random bits from a random stream. Whole blocks are
+// generated straight into the array from independent counters, which
+// compilers can vectorise.
+//
+// PARAMS:
+// r   - the random stream
+// out - the array to fill
+// n   - number of elements
+void prethd_rng_fill_u32(prethd_rng_t *r, uint32_t *out, size_t n);
+
+// Fills an array with random numbers from a random stream, uniform in
+// [0, 1).
+//
+// PARAMS:
+// r   - the random stream
+// out - the array to fill
+// n   - number of elements
+void prethd_rng_fill_double(prethd_rng_t *r, double *out, size_t n);
+
+// Allocates the ring used by prethd_submit_from_signal(). Must be called
+// before any task is submitted from a signal handler.
+//
+// PARAMS:
+// th - the thread pool to allocate the ring for
+// n  - number of slots, rounded up to a power of two
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sigring(prethd_t *th, size_t n);
+
+// Queues a task from a signal handler. Async-signal-safe: the task goes
+// into the ring allocated by prethd_sigring() without locking or
+// allocating, and a thread of the first executor class is woken with
+// sem_post().
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error or if the ring is full.
+_Bool prethd_submit_from_signal(prethd_t *th, void *(*func)(void *),
+        void *arg);
+
+// Restarts the threads of a pool inherited across fork(). The child gets
+// the pool with its mutexes and conditional variables reinitialised but
+// without any threads; this starts them again with the task loop, or with
+// the function and argument given to the last prethd_all().
+//
+// Before every fork() the pools' internal locks are taken, so that no
+// pool operation is caught halfway in the child. The mutexes of
+// prethd_lock() are not taken: the child gets them reset, unlocked, so
+// fork() must not be called while holding one, and the data one guards
+// is only consistent in the child if no other thread held it at the fork.
+//
+// PARAMS:
+// th - the inherited thread pool to restart
+//
+// RETURN:
+// The number of threads started, 0 on error.
+size_t prethd_respawn(prethd_t *th);
+
 // Returns the number of threads in the thread pool.
 //
 // PARAMS:
@@ -61,7 +587,8 @@ size_t prethd_mutex_size(prethd_t *th);
 // The thread pool conditional variable size, or 0 on error.
 size_t prethd_cond_size(prethd_t *th);
 
-// Joins all threads in the thread pool.
+// Joins all threads in the thread pool. Threads running the task loop
+// first finish every queued task.
 //
 // PARAMS:
 // th - the thread pool to join
@@ -70,6 +597,34 @@ size_t prethd_cond_size(prethd_t *th);
 // 1 (true) on success, 0 (false) on error.
 _Bool prethd_join(prethd_t *th);
 
+// Shuts down the threads of the given thread pool. Threads running the
+// task loop finish their current task and exit; depending on the mode,
+// queued tasks are run first or dropped. The call waits for the threads
+// no later than the deadline, then joins them. On timeout the threads
+// are left to finish, and the call can be repeated to wait for them
+// again. The pool can be started again once shut down.
+//
+// PARAMS:
+// th       - the thread pool to shut down
+// mode     - what happens to queued and running tasks
+// deadline - absolute CLOCK_REALTIME time to give up at, or NULL to wait
+//            as long as needed; only bounds threads running the task loop
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error or timeout.
+_Bool prethd_shutdown(prethd_t *th, prethd_mode_t mode,
+        const struct timespec *deadline);
+
+// Tells a running task whether the pool is being shut down with
+// PRETHD_ABORT, so that long tasks can return early.
+//
+// PARAMS:
+// th - the thread pool running the task
+//
+// RETURN:
+// 1 (true) if the task should return early, 0 (false) otherwise.
+_Bool prethd_aborted(prethd_t *th);
+
 // Locks the given thread pool.
 //
 // PARAMS:
@@ -122,6 +677,463 @@ _Bool prethd_signal(prethd_t *th, size_t i);
 // 1 (true) on success, 0 (false) on error.
 _Bool prethd_broad(prethd_t *th, size_t i);
 
+// Allocates a bounded queue of pointers for producer and consumer threads,
+// guarded by a mutex of the given thread pool. Consumers wait on one
+// conditional variable and producers on another, and each is only
+// signalled when a thread waits on it. Being the pool's own, the sync
+// objects are reset across fork() with the rest. The conditional variables
+// must not be used for anything else.
+//
+// PARAMS:
+// th  - the thread pool owning the sync objects
+// cap - maximum number of items in the queue
+// m   - the mutex index to guard the queue with
+// ne  - the conditional variable index consumers wait on
+// nf  - the conditional variable index producers wait on
+//
+// RETURN:
+// The queue, or NULL on error.
+prethd_bqueue_t *prethd_bqueue_new(prethd_t *th, size_t cap, size_t m,
+        size_t ne, size_t nf);
+
+// Adds items to a queue, in order, waiting for room whenever it is full.
+// Consumers are woken once per batch of items that fit rather than once
+// per item.
+//
+// PARAMS:
+// q     - the queue to add to
+// items - the items to add
+// n     - number of items
+//
+// RETURN:
+// The number of items added, less than n if the queue was closed
+// meanwhile.
+size_t prethd_bqueue_push(prethd_bqueue_t *q, void *const *items, size_t n);
+
+// Takes up to max items off a queue, in order, waiting until there is at
+// least one.
+//
+// PARAMS:
+// q     - the queue to take from
+// items - receives the items
+// max   - most items to take
+//
+// RETURN:
+// The number of items taken, 0 on error or if the queue is closed and
+// empty.
+size_t prethd_bqueue_pop(prethd_bqueue_t *q, void **items, size_t max);
+
+// Closes a queue: further pushes fail, pops return the items left and
+// then 0, and every waiting thread is woken.
+//
+// PARAMS:
+// q - the queue to close
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_bqueue_close(prethd_bqueue_t *q);
+
+// Returns the number of items in a queue.
+//
+// PARAMS:
+// q - the queue
+//
+// RETURN:
+// The number of items, 0 on error.
+size_t prethd_bqueue_len(prethd_bqueue_t *q);
+
+// Frees a queue. No thread may be waiting on it.
+//
+// PARAMS:
+// q - the queue to free
+void prethd_bqueue_free(prethd_bqueue_t *q);
+
+// Allocates the counting semaphores of the thread pool, next to its
+// mutexes and conditional variables. Acquiring a free permit and releasing
+// one without waiters stays in user space.
+//
+// PARAMS:
+// th     - the thread pool to allocate the semaphores for
+// values - initial permit count of each semaphore
+// n      - number of semaphores
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sems(prethd_t *th, const unsigned *values, size_t n);
+
+// Returns the number of semaphores in the thread pool.
+//
+// PARAMS:
+// th - the thread pool to retrieve the size
+//
+// RETURN:
+// The thread pool semaphore size, or 0 on error.
+size_t prethd_sem_size(prethd_t *th);
+
+// Acquires a permit from a semaphore in the given thread pool, waiting
+// until one is available.
+//
+// PARAMS:
+// th - the thread pool to acquire from
+// i  - the index of semaphore to acquire
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sem_acquire(prethd_t *th, size_t i);
+
+// Acquires a permit from a semaphore in the given thread pool, waiting no
+// later than the given time.
+//
+// PARAMS:
+// th      - the thread pool to acquire from
+// i       - the index of semaphore to acquire
+// abstime - absolute CLOCK_REALTIME time to give up at
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error or timeout.
+_Bool prethd_sem_timed(prethd_t *th, size_t i,
+        const struct timespec *abstime);
+
+// Acquires a permit from a semaphore in the given thread pool without
+// waiting.
+//
+// PARAMS:
+// th - the thread pool to acquire from
+// i  - the index of semaphore to acquire
+//
+// RETURN:
+// 1 (true) if a permit was acquired, 0 (false) on error or if none is
+// available.
+_Bool prethd_sem_try(prethd_t *th, size_t i);
+
+// Releases a permit to a semaphore in the given thread pool. The permit
+// goes to a parked bulkhead task if there is one.
+//
+// PARAMS:
+// th - the thread pool to release to
+// i  - the index of semaphore to release
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sem_release(prethd_t *th, size_t i);
+
+// Queues a task behind a bulkhead: at most as many tasks as the semaphore
+// has permits run at once. A task finding no permit is parked without
+// holding up a thread, and is queued again once a permit is released.
+// The permit is released when the function returns.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// c    - the executor class index
+// s    - the index of semaphore limiting the task
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_submit_bulkhead(prethd_t *th, size_t c, size_t s,
+        void *(*func)(void *), void *arg);
+
+// Counts items into bins using the threads of the given thread pool. Each
+// thread counts a chunk of the items into its own table, small enough to
+// stay in its cache, and the tables are then added up pairwise in
+// parallel. Items binned past the last bin are skipped.
+//
+// PARAMS:
+// th     - the thread pool to count with
+// data   - the items to count
+// n      - number of items
+// size   - size of each item
+// bin    - returns the bin of an item
+// ctx    - argument for bin
+// counts - receives the count of each bin
+// nbins  - number of bins
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_parallel_histogram(prethd_t *th, const void *data, size_t n,
+        size_t size, size_t (*bin)(const void *item, void *ctx), void *ctx,
+        size_t *counts, size_t nbins);
+
+// Groups values by key and adds them up using the threads of the given
+// thread pool. Each thread groups a chunk of the items into its own hash
+// table, and the tables are then merged pairwise in parallel. The groups
+// are returned sorted by key.
+//
+// PARAMS:
+// th   - the thread pool to group with
+// keys - the key of each item
+// vals - the value of each item
+// n    - number of items
+// out  - receives the groups, freed with free()
+//
+// RETURN:
+// The number of groups, or 0 on error.
+size_t prethd_parallel_groupby(prethd_t *th, const uint64_t *keys,
+        const double *vals, size_t n, prethd_group_t **out);
+
+// Copies the items matching a predicate, in their original order, using
+// the threads of the given thread pool. Each thread counts the matches in
+// a chunk of the items, the counts are summed into output offsets, and
+// each thread then copies its matches to its own offset, so no locking is
+// needed. The predicate is called twice for each item and must return the
+// same both times.
+//
+// PARAMS:
+// th   - the thread pool to filter with
+// data - the items to filter
+// n    - number of items
+// size - size of each item
+// pred - returns 1 (true) for the items to keep
+// ctx  - argument for pred
+// out  - receives the kept items, room for n items not overlapping data
+// len  - receives the number of kept items
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_parallel_filter(prethd_t *th, const void *data, size_t n,
+        size_t size, _Bool (*pred)(const void *item, void *ctx), void *ctx,
+        void *out, size_t *len);
+
+// Partitions items by a predicate, keeping the original order within both
+// parts, using the threads of the given thread pool as in
+// prethd_parallel_filter(). The predicate is called twice for each item
+// and must return the same both times.
+//
+// PARAMS:
+// th   - the thread pool to partition with
+// data - the items to partition
+// n    - number of items
+// size - size of each item
+// pred - returns 1 (true) for the items of the first part
+// ctx  - argument for pred
+// out  - receives the first part then the second, room for n items not
+//        overlapping data
+// len  - receives the number of items in the first part
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_parallel_partition(prethd_t *th, const void *data, size_t n,
+        size_t size, _Bool (*pred)(const void *item, void *ctx), void *ctx,
+        void *out, size_t *len);
+
+// Computes the distance in edges of every vertex from a source vertex with
+// a breadth-first search using the threads of the given thread pool. The
+// graph is in compressed sparse row form: the out-neighbours of vertex v
+// are adj[offs[v]] to adj[offs[v + 1] - 1]. Levels with a small frontier
+// are expanded top-down from a vertex list, each thread collecting the
+// vertices it finds in its own buffer. Levels with a large frontier are
+// expanded bottom-up, each thread checking its own range of unvisited
+// vertices for an in-neighbour in a bitmap of the frontier. Neither needs
+// a lock.
+//
+// PARAMS:
+// th    - the thread pool to search with
+// offs  - out-edge offsets of each vertex, nv + 1 of them
+// adj   - out-neighbours of all vertices
+// roffs - in-edge offsets of each vertex, NULL if the graph is undirected
+// radj  - in-neighbours of all vertices, NULL if the graph is undirected
+// nv    - number of vertices
+// src   - the source vertex
+// dist  - receives the distance of each vertex, SIZE_MAX if unreachable
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_parallel_bfs(prethd_t *th, const size_t *offs,
+        const size_t *adj, const size_t *roffs, const size_t *radj,
+        size_t nv, size_t src, size_t *dist);
+
+// Queues a task for the threads of an executor class in a started pool,
+// returning a future for its result.
+//
+// PARAMS:
+// th   - the thread pool to run the task
+// c    - the executor class index
+// func - function to run
+// arg  - argument for the function
+//
+// RETURN:
+// The future of the task, freed with prethd_future_free(), or NULL on
+// error.
+prethd_future_t *prethd_async(prethd_t *th, size_t c,
+        void *(*func)(void *), void *arg);
+
+// Waits for the task of a future to return. Called from a task of the
+// pool, the calling thread runs other queued tasks of its class while
+// waiting.
+//
+// PARAMS:
+// f   - the future to wait for
+// ret - receives the value returned by the task, can be NULL
+//
+// RETURN:
+// 1 (true) if the task returned, 0 (false) on error or if it was
+// cancelled before it started.
+_Bool prethd_future_get(prethd_future_t *f, void **ret);
+
+// Cancels the task of a future. A task not started yet never runs; a
+// running task sees prethd_cancelled() return true and may return early.
+//
+// PARAMS:
+// f - the future to cancel
+//
+// RETURN:
+// 1 (true) if the task had not returned yet, 0 (false) otherwise.
+_Bool prethd_future_cancel(prethd_future_t *f);
+
+// Tells a running task whether its future was cancelled, or the pool is
+// being shut down with PRETHD_ABORT, so that it can return early.
+//
+// PARAMS:
+// th - the thread pool running the task
+//
+// RETURN:
+// 1 (true) if the task should return early, 0 (false) otherwise.
+_Bool prethd_cancelled(prethd_t *th);
+
+// Frees a future. The task of the future is not cancelled and may still
+// run.
+//
+// PARAMS:
+// f - the future to free
+void prethd_future_free(prethd_future_t *f);
+
+// Waits for the tasks of all the futures to return or be cancelled.
+// Called from a task of the pool, the calling thread runs other queued
+// tasks of its class while waiting.
+//
+// PARAMS:
+// futs - the futures to wait for
+// n    - number of futures
+//
+// RETURN:
+// 1 (true) if every task returned, 0 (false) on error or if any was
+// cancelled before it started.
+_Bool prethd_when_all(prethd_future_t **futs, size_t n);
+
+// Waits for the first task of the futures to return, then cancels the
+// others: tasks not started yet never run, and running ones see
+// prethd_cancelled() return true. Called from a task of the pool, the
+// calling thread runs other queued tasks of its class while waiting.
+//
+// PARAMS:
+// futs - the futures to wait for
+// n    - number of futures
+// ret  - receives the value returned by the first task, can be NULL
+//
+// RETURN:
+// The index of the first future whose task returned, or n on error or if
+// every task was cancelled before it started.
+size_t prethd_when_any(prethd_future_t **futs, size_t n, void **ret);
+
+// Sets up a frame for a task of the pool to spawn subtasks in, which
+// must be ended with prethd_sync() before the task returns.
+//
+// PARAMS:
+// th    - the thread pool running the task
+// frame - the frame to set up, usually on the stack of the task
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_frame(prethd_t *th, prethd_frame_t *frame);
+
+// Spawns a subtask in a frame. The calling thread pushes it onto its own
+// deque and goes on with the rest of the task, while idle threads of its
+// class steal the oldest subtasks, which are the largest ones in divide
+// and conquer. Outside the pool's threads, the subtask is run at once.
+//
+// PARAMS:
+// frame - the frame of the calling task
+// func  - function to run
+// arg   - argument for the function
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_spawn(prethd_frame_t *frame, void *(*func)(void *), void *arg);
+
+// Waits for the subtasks spawned in a frame and ends the frame. The
+// calling thread runs the subtasks nobody stole, newest first, then runs
+// other tasks of its class while the stolen ones finish. As each thread
+// only keeps the subtasks of the frames it is in, memory use is bounded
+// by the depth of the recursion.
+//
+// PARAMS:
+// frame - the frame of the calling task
+//
+// RETURN:
+// 1 (true) on success, 0 (false) on error.
+_Bool prethd_sync(prethd_frame_t *frame);
+
+// Allocates an empty ordered map from 64-bit keys to pointers, safe for
+// any number of threads to use at once without locking. Removed entries
+// are reclaimed through the pool once no thread can still be reading
+// them, so the pool must outlive the map.
+//
+// PARAMS:
+// th - the thread pool reclaiming removed entries
+//
+// RETURN:
+// The map, or NULL on error.
+prethd_skip_t *prethd_skip_new(prethd_t *th);
+
+// Adds an entry to a map, unless its key is in the map already.
+//
+// PARAMS:
+// s   - the map to add to
+// key - key of the entry
+// val - value of the entry
+//
+// RETURN:
+// 1 (true) if the entry was added, 0 (false) on error or if the key was
+// in the map.
+_Bool prethd_skip_insert(prethd_skip_t *s, uint64_t key, void *val);
+
+// Removes the entry with the given key from a map.
+//
+// PARAMS:
+// s   - the map to remove from
+// key - key of the entry
+// val - receives the value of the entry, can be NULL
+//
+// RETURN:
+// 1 (true) if the entry was removed, 0 (false) on error or if the key was
+// not in the map.
+_Bool prethd_skip_erase(prethd_skip_t *s, uint64_t key, void **val);
+
+// Looks up the entry with the given key in a map.
+//
+// PARAMS:
+// s   - the map to look in
+// key - key of the entry
+// val - receives the value of the entry, can be NULL
+//
+// RETURN:
+// 1 (true) if the key is in the map, 0 (false) on error or otherwise.
+_Bool prethd_skip_find(prethd_skip_t *s, uint64_t key, void **val);
+
+// Calls a function on the entries of a map with keys from lo up to but
+// excluding hi, in key order. Entries added or removed during the scan
+// may or may not be seen. Removed entries are not reclaimed while a scan
+// is running, so the function should not block.
+//
+// PARAMS:
+// s   - the map to scan
+// lo  - lowest key to visit
+// hi  - key to stop before
+// fn  - called on each entry, returns 0 (false) to stop the scan
+// ctx - argument for fn
+//
+// RETURN:
+// The number of entries visited.
+size_t prethd_skip_range(prethd_skip_t *s, uint64_t lo, uint64_t hi,
+        _Bool (*fn)(uint64_t key, void *val, void *ctx), void *ctx);
+
+// Frees a map. No other thread may be using it.
+//
+// PARAMS:
+// s - the map to free
+void prethd_skip_free(prethd_skip_t *s);
+
 // Frees the specified thread pool.
 //
 // PARAMS:
@@ -129,7 +1141,8 @@ _Bool prethd_broad(prethd_t *th, size_t i);
 void prethd_free(prethd_t *th);
 
 // Frees the specified thread pool. Waits for all threads to join before
-// freeing.
+// freeing. If they cannot be joined, e.g. pthread_join() fails, the pool
+// is leaked rather than freed under threads that may still use it.
 //
 // PARAMS:
 // th - the thread pool to free